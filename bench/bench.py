@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+#
+# nrfdfu - Nordic DFU Upgrade Utility
+#
+# Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Throughput benchmark of nrfdfu serial against nrfdfu-emu over a pty.
+
+Runs every combination of image size, MTU, object size, PRN and simulated
+link rate and prints one JSON object per run, so the results of two commits
+can be compared."""
+
+import argparse
+import itertools
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+import zipfile
+
+MANIFEST = {
+    "manifest": {
+        "application": {"bin_file": "app.bin", "dat_file": "app.dat"}
+    }
+}
+
+# image types and size fields of the InitCommand in dfu-cc.proto
+FW_TYPE_APPLICATION = 0
+FW_TYPE_BOOTLOADER = 2
+INIT_SIZE_FIELD = {FW_TYPE_APPLICATION: 7, FW_TYPE_BOOTLOADER: 6}
+
+
+def int_list(text):
+    return [int(x) for x in text.split(",")]
+
+
+def pb_varint(value):
+    out = b""
+    while value > 0x7f:
+        out += bytes([value & 0x7f | 0x80])
+        value >>= 7
+    return out + bytes([value])
+
+
+def pb_field(num, value):
+    """protobuf field, a varint for int values, length delimited for bytes"""
+    if isinstance(value, int):
+        return pb_varint(num << 3) + pb_varint(value)
+    return pb_varint(num << 3 | 2) + pb_varint(len(value)) + value
+
+
+def init_packet(fw_type, version, size):
+    """unsigned init packet, so the emulator knows when the image is
+    complete"""
+    init = (pb_field(1, version) + pb_field(2, 52) + pb_field(4, fw_type)
+            + pb_field(INIT_SIZE_FIELD[fw_type], size))
+    return pb_field(1, pb_field(1, 1) + pb_field(2, init))
+
+
+def make_package(path, size, bootloader=False):
+    """DFU package with a random application of size bytes. With bootloader
+    a bootloader of the same size comes first, after which the emulator
+    resets"""
+    with zipfile.ZipFile(path, "w", zipfile.ZIP_DEFLATED) as z:
+        if not bootloader:
+            z.writestr("manifest.json", json.dumps(MANIFEST))
+            z.writestr("app.dat", os.urandom(141))
+            z.writestr("app.bin", os.urandom(size))
+            return
+        manifest = {
+            "bootloader": {"bin_file": "bl.bin", "dat_file": "bl.dat"},
+            "application": {"bin_file": "app.bin", "dat_file": "app.dat"},
+        }
+        z.writestr("manifest.json", json.dumps({"manifest": manifest}))
+        z.writestr("bl.dat", init_packet(FW_TYPE_BOOTLOADER, 2, size))
+        z.writestr("bl.bin", os.urandom(size))
+        z.writestr("app.dat", init_packet(FW_TYPE_APPLICATION, 1, size))
+        z.writestr("app.bin", os.urandom(size))
+
+
+def wait_for(path, timeout):
+    end = time.monotonic() + timeout
+    while not os.path.exists(path):
+        if time.monotonic() > end:
+            return False
+        time.sleep(0.01)
+    return True
+
+
+def git_commit():
+    try:
+        return subprocess.check_output(
+            ["git", "rev-parse", "--short", "HEAD"],
+            cwd=os.path.dirname(os.path.abspath(__file__)),
+            stderr=subprocess.DEVNULL, text=True).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def run(args, tmp, pkg, size, mtu, obj, prn, rate):
+    link = os.path.join(tmp, "tty")
+    stats_file = os.path.join(tmp, "stats.json")
+    for f in (link, stats_file):
+        if os.path.lexists(f):
+            os.unlink(f)
+
+    emu_cmd = [args.emu, "-l", link, "-m", str(mtu), "-s", str(obj),
+               "-o", stats_file]
+    if rate:
+        emu_cmd += ["-r", str(rate)]
+    if args.prn_crc:
+        emu_cmd.append("-c")
+    emu = subprocess.Popen(emu_cmd, stdout=subprocess.DEVNULL,
+                           stderr=subprocess.DEVNULL)
+    try:
+        if not wait_for(link, 5):
+            raise RuntimeError("emulator did not start")
+
+        cmd = [args.nrfdfu, "serial", "-p", link, "-n", str(prn)]
+        if rate:
+            cmd += ["-B", str(rate)]
+        cmd.append(pkg)
+
+        start = time.monotonic()
+        proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL,
+                                stderr=subprocess.DEVNULL)
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.monotonic() - start
+        proc.returncode = os.waitstatus_to_exitcode(status)
+    finally:
+        emu.terminate()
+        emu.wait()
+
+    with open(stats_file) as f:
+        emu_stats = json.load(f)
+
+    cpu = usage.ru_utime + usage.ru_stime
+    return {
+        "commit": args.commit,
+        "size": size,
+        "mtu": mtu,
+        "object_size": obj,
+        "prn": prn,
+        "rate": rate,
+        "ok": proc.returncode == 0 and emu_stats["bytes"] >= size,
+        "wall_s": round(wall, 4),
+        "bytes_per_s": round(size / wall) if wall > 0 else None,
+        "setup_s": emu_stats["setup_us"] / 1e6,
+        "init_s": emu_stats["init_us"] / 1e6,
+        "data_s": emu_stats["data_us"] / 1e6,
+        "cpu_s": round(cpu, 4),
+        "cpu_s_per_mb": round(cpu / (size / 1e6), 4),
+        "frames": emu_stats["frames"],
+    }
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__)
+    p.add_argument("--nrfdfu", required=True, help="nrfdfu executable")
+    p.add_argument("--emu", required=True, help="nrfdfu-emu executable")
+    p.add_argument("--size", type=int_list, default=[65536, 262144],
+                   help="image sizes in bytes (65536,262144)")
+    p.add_argument("--mtu", type=int_list, default=[65, 131, 1024],
+                   help="MTUs (65,131,1024)")
+    p.add_argument("--object-size", type=int_list, default=[4096],
+                   help="maximum data object sizes (4096)")
+    p.add_argument("--prn", type=int_list, default=[0, 8],
+                   help="packet receipt notification settings (0,8)")
+    p.add_argument("--rate", type=int_list, default=[0, 1000000],
+                   help="simulated link baud rates, 0 unlimited (0,1000000)")
+    p.add_argument("--prn-crc", action="store_true",
+                   help="emulator sends notifications as CRC responses, "
+                   "like the BLE bootloader")
+    p.add_argument("--bootloader", action="store_true",
+                   help="update a bootloader before the application, so "
+                   "nrfdfu waits for the emulator to reset in between")
+    p.add_argument("--output", help="append results to this file")
+    args = p.parse_args()
+    args.commit = git_commit()
+
+    out = open(args.output, "a") if args.output else sys.stdout
+    failed = 0
+    with tempfile.TemporaryDirectory(prefix="nrfdfu-bench-") as tmp:
+        pkgs = {}
+        for size in args.size:
+            pkgs[size] = os.path.join(tmp, "app-%d.zip" % size)
+            make_package(pkgs[size], size, args.bootloader)
+
+        for size, mtu, obj, prn, rate in itertools.product(
+                args.size, args.mtu, args.object_size, args.prn, args.rate):
+            res = run(args, tmp, pkgs[size], size, mtu, obj, prn, rate)
+            failed += not res["ok"]
+            out.write(json.dumps(res) + "\n")
+            out.flush()
+            if out is not sys.stdout:
+                print("size %d mtu %d obj %d prn %d rate %d: %s B/s" %
+                      (size, mtu, obj, prn, rate, res["bytes_per_s"]))
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,338 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "cache.h"
+#include "log.h"
+#include "util.h"
+
+/*
+ * A cache file holds a header, one entry per image and the data the entries
+ * point to: init packet, its CRC table, firmware and its CRC table, each
+ * aligned to 8 bytes. It is only read on the machine which wrote it, so
+ * everything is in host byte order.
+ */
+#define CACHE_MAGIC		 "nrfdfu\0\1"
+#define CACHE_MAX_IMAGES 4
+#define CACHE_NAME_LEN	 32
+#define CACHE_ALIGN(x)	 (((x) + 7) & ~(uint64_t)7)
+
+struct cache_header {
+	char magic[8];
+	uint32_t num;
+	uint32_t reserved;
+};
+
+struct cache_entry {
+	char name[CACHE_NAME_LEN];
+	uint64_t dat_off;
+	uint64_t dat_size;
+	uint64_t dat_crcs_off;
+	uint64_t bin_off;
+	uint64_t bin_size;
+	uint64_t bin_crcs_off;
+};
+
+static const char* cache_dir;
+static char cache_key_str[40];
+static char cache_file[PATH_MAX];
+static void* cache_map;
+static size_t cache_len;
+
+static uint8_t* cache_at(uint64_t off)
+{
+	return (uint8_t*)cache_map + off;
+}
+
+static size_t crcs_size(uint64_t size)
+{
+	return (size / DFU_CRC_STEP + 1) * sizeof(uint32_t);
+}
+
+/* the key is a CRC32 and an Adler-32 of the package and its size */
+static bool cache_key(const char* pkg, char* key, size_t len)
+{
+	struct stat st;
+	int fd = open(pkg, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		LOG_WARN("Cache: could not open '%s': %s", pkg, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+
+	uint32_t crc = crc32(0L, Z_NULL, 0);
+	uint32_t adler = adler32(0L, Z_NULL, 0);
+	if (st.st_size > 0) {
+		void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			LOG_WARN("Cache: could not map '%s': %s", pkg, strerror(errno));
+			close(fd);
+			return false;
+		}
+		/* zlib takes 32 bit lengths */
+		for (off_t pos = 0; pos < st.st_size; pos += 1 << 30) {
+			uInt n = MIN(st.st_size - pos, 1 << 30);
+			crc = crc32(crc, (uint8_t*)p + pos, n);
+			adler = adler32(adler, (uint8_t*)p + pos, n);
+		}
+		munmap(p, st.st_size);
+	}
+	close(fd);
+
+	snprintf(key, len, "%08x%08x%016llx", crc, adler,
+			 (unsigned long long)st.st_size);
+	return true;
+}
+
+bool cache_open(const char* dir, const char* pkg)
+{
+	if (!cache_key(pkg, cache_key_str, sizeof(cache_key_str))) {
+		return false;
+	}
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		LOG_WARN("Cache: could not create '%s': %s", dir, strerror(errno));
+		return false;
+	}
+
+	cache_dir = dir;
+	cache_variant(NULL);
+	return true;
+}
+
+void cache_variant(const char* variant)
+{
+	if (!cache_key_str[0]) {
+		return;
+	}
+	if (variant) {
+		snprintf(cache_file, sizeof(cache_file), "%s/%s-%s.img", cache_dir,
+				 cache_key_str, variant);
+	} else {
+		snprintf(cache_file, sizeof(cache_file), "%s/%s.img", cache_dir,
+				 cache_key_str);
+	}
+}
+
+/* a bundle has an empty file "<key>.bundle" instead of images */
+static void cache_bundle_file(char* buf, size_t len)
+{
+	snprintf(buf, len, "%s/%s.bundle", cache_dir, cache_key_str);
+}
+
+bool cache_is_bundle(void)
+{
+	char file[PATH_MAX];
+
+	if (!cache_key_str[0]) {
+		return false;
+	}
+	cache_bundle_file(file, sizeof(file));
+	return access(file, F_OK) == 0;
+}
+
+void cache_store_bundle(void)
+{
+	char file[PATH_MAX];
+
+	if (!cache_key_str[0]) {
+		return;
+	}
+	cache_bundle_file(file, sizeof(file));
+	int fd = open(file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		LOG_WARN("Cache: could not write '%s': %s", file, strerror(errno));
+		return;
+	}
+	close(fd);
+}
+
+/* entry data has to be inside the file and the CRC tables have to match */
+static bool cache_entry_valid(const struct cache_entry* e)
+{
+	if (memchr(e->name, '\0', sizeof(e->name)) == NULL
+		|| e->dat_off > cache_len || e->dat_size > cache_len - e->dat_off
+		|| e->bin_off > cache_len || e->bin_size > cache_len - e->bin_off
+		|| e->dat_crcs_off % 4 || e->dat_crcs_off > cache_len
+		|| crcs_size(e->dat_size) > cache_len - e->dat_crcs_off
+		|| e->bin_crcs_off % 4 || e->bin_crcs_off > cache_len
+		|| crcs_size(e->bin_size) > cache_len - e->bin_crcs_off) {
+		return false;
+	}
+
+	const uint8_t* dat = cache_at(e->dat_off);
+	const uint8_t* bin = cache_at(e->bin_off);
+	uint32_t crc0 = crc32(0L, Z_NULL, 0);
+
+	return dfu_crc_at(dat, (uint32_t*)cache_at(e->dat_crcs_off), e->dat_size)
+			   == crc32(crc0, dat, e->dat_size)
+		   && dfu_crc_at(bin, (uint32_t*)cache_at(e->bin_crcs_off),
+						 e->bin_size)
+				  == crc32(crc0, bin, e->bin_size);
+}
+
+int cache_load(struct dfu_image* img, int max)
+{
+	struct stat st;
+
+	if (!cache_file[0]) {
+		return 0;
+	}
+
+	int fd = open(cache_file, O_RDONLY);
+	if (fd < 0) {
+		LOG_INF("Cache: no entry '%s'", cache_file);
+		return 0;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct cache_header)) {
+		close(fd);
+		goto invalid;
+	}
+
+	cache_len = st.st_size;
+	cache_map = mmap(NULL, cache_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache_map == MAP_FAILED) {
+		cache_map = NULL;
+		goto invalid;
+	}
+
+	const struct cache_header* hdr = cache_map;
+	const struct cache_entry* ent = (const struct cache_entry*)(hdr + 1);
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) != 0
+		|| hdr->num == 0 || hdr->num > (uint32_t)max
+		|| hdr->num > CACHE_MAX_IMAGES
+		|| sizeof(*hdr) + hdr->num * sizeof(*ent) > cache_len) {
+		goto invalid;
+	}
+
+	for (uint32_t i = 0; i < hdr->num; i++) {
+		if (!cache_entry_valid(&ent[i])) {
+			goto invalid;
+		}
+		img[i].name = ent[i].name;
+		img[i].dat = cache_at(ent[i].dat_off);
+		img[i].dat_size = ent[i].dat_size;
+		img[i].dat_crcs = (uint32_t*)cache_at(ent[i].dat_crcs_off);
+		img[i].bin = cache_at(ent[i].bin_off);
+		img[i].bin_size = ent[i].bin_size;
+		img[i].bin_crcs = (uint32_t*)cache_at(ent[i].bin_crcs_off);
+	}
+
+	LOG_INF("Cache: images loaded from '%s'", cache_file);
+	return hdr->num;
+
+invalid:
+	LOG_WARN("Cache: ignoring invalid file '%s'", cache_file);
+	cache_close();
+	return 0;
+}
+
+/* write data at offset off, padding from the current position pos */
+static bool cache_put(FILE* f, uint64_t* pos, uint64_t off, const void* data,
+					  size_t len)
+{
+	static const uint8_t zero[8];
+
+	if (fwrite(zero, 1, off - *pos, f) != off - *pos
+		|| fwrite(data, 1, len, f) != len) {
+		return false;
+	}
+	*pos = off + len;
+	return true;
+}
+
+void cache_store(const struct dfu_image* img, int num)
+{
+	struct cache_header hdr = {.num = num};
+	struct cache_entry ent[CACHE_MAX_IMAGES] = {};
+	char tmp[PATH_MAX + 20];
+	uint64_t pos;
+	bool ok = true;
+
+	if (!cache_file[0] || num > CACHE_MAX_IMAGES) {
+		return;
+	}
+
+	/* layout */
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	pos = sizeof(hdr) + num * sizeof(*ent);
+	for (int i = 0; i < num; i++) {
+		snprintf(ent[i].name, sizeof(ent[i].name), "%s", img[i].name);
+		ent[i].dat_size = img[i].dat_size;
+		ent[i].bin_size = img[i].bin_size;
+		ent[i].dat_off = CACHE_ALIGN(pos);
+		ent[i].dat_crcs_off = CACHE_ALIGN(ent[i].dat_off + img[i].dat_size);
+		ent[i].bin_off = CACHE_ALIGN(ent[i].dat_crcs_off
+									 + crcs_size(img[i].dat_size));
+		ent[i].bin_crcs_off = CACHE_ALIGN(ent[i].bin_off + img[i].bin_size);
+		pos = ent[i].bin_crcs_off + crcs_size(img[i].bin_size);
+	}
+
+	/* other runs may read it at the same time, so write a new file and
+	 * rename it */
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", cache_file, getpid());
+	FILE* f = fopen(tmp, "w");
+	if (f == NULL) {
+		LOG_WARN("Cache: could not write '%s': %s", tmp, strerror(errno));
+		return;
+	}
+
+	pos = 0;
+	ok = cache_put(f, &pos, 0, &hdr, sizeof(hdr))
+		 && cache_put(f, &pos, pos, ent, num * sizeof(*ent));
+	for (int i = 0; ok && i < num; i++) {
+		ok = cache_put(f, &pos, ent[i].dat_off, img[i].dat, img[i].dat_size)
+			 && cache_put(f, &pos, ent[i].dat_crcs_off, img[i].dat_crcs,
+						  crcs_size(img[i].dat_size))
+			 && cache_put(f, &pos, ent[i].bin_off, img[i].bin,
+						  img[i].bin_size)
+			 && cache_put(f, &pos, ent[i].bin_crcs_off, img[i].bin_crcs,
+						  crcs_size(img[i].bin_size));
+	}
+
+	if (fclose(f) != 0 || !ok || rename(tmp, cache_file) != 0) {
+		LOG_WARN("Cache: could not write '%s': %s", cache_file,
+				 strerror(errno));
+		unlink(tmp);
+		return;
+	}
+	LOG_INF("Cache: images stored in '%s'", cache_file);
+}
+
+void cache_close(void)
+{
+	if (cache_map) {
+		munmap(cache_map, cache_len);
+		cache_map = NULL;
+	}
+}
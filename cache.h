@@ -0,0 +1,45 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+
+#include "dfu.h"
+
+/* On-disk cache of the decompressed images of DFU packages with their CRC
+ * tables, keyed by a hash of the package file and the variant directory of a
+ * bundle. Cached images are mmapped and stay valid until cache_close() */
+/* dir has to stay valid while the cache is used */
+bool cache_open(const char* dir, const char* pkg);
+/* use the entry of the package in directory variant of a bundle, NULL for
+ * the package itself */
+void cache_variant(const char* variant);
+/* whether the package was found to be a bundle before, so it doesn't have
+ * to be opened to find out */
+bool cache_is_bundle(void);
+void cache_store_bundle(void);
+/* images of the package, or 0 when it is not in the cache */
+int cache_load(struct dfu_image* img, int max);
+void cache_store(const struct dfu_image* img, int num);
+void cache_close(void);
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "log.h"
+#include "util.h"
+
+#define CAPTURE_BUF_SIZE (64 * 1024)
+
+/* pcapng block types and options */
+#define PCAPNG_SHB		  0x0A0D0D0A
+#define PCAPNG_IDB		  0x00000001
+#define PCAPNG_EPB		  0x00000006
+#define PCAPNG_MAGIC	  0x1A2B3C4D
+#define PCAPNG_OPT_END	  0
+#define PCAPNG_IF_NAME	  2
+#define PCAPNG_EPB_FLAGS  2
+
+#define PAD4(_x) (((_x) + 3) & ~3)
+
+static int cap_fd = -1;
+static int num_intf;
+/* frames are collected here and written when it is full */
+static uint8_t buf[CAPTURE_BUF_SIZE];
+static size_t buf_len;
+/* timestamps are monotonic, counted from the wall clock at the start */
+static uint64_t mono_start;
+static uint64_t real_start;
+
+static void capture_flush(void)
+{
+	size_t pos = 0;
+
+	while (pos < buf_len) {
+		ssize_t ret = write(cap_fd, buf + pos, buf_len - pos);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG_ERR("Capture write error: %s", strerror(errno));
+			close(cap_fd);
+			cap_fd = -1;
+			break;
+		}
+		pos += ret;
+	}
+	buf_len = 0;
+}
+
+/* room for len bytes in the buffer */
+static uint8_t* capture_reserve(size_t len)
+{
+	if (buf_len + len > sizeof(buf)) {
+		capture_flush();
+	}
+	if (cap_fd < 0 || len > sizeof(buf)) {
+		return NULL;
+	}
+	uint8_t* p = buf + buf_len;
+	buf_len += len;
+	return p;
+}
+
+static uint8_t* put32(uint8_t* p, uint32_t v)
+{
+	memcpy(p, &v, 4);
+	return p + 4;
+}
+
+static uint8_t* put16(uint8_t* p, uint16_t v)
+{
+	memcpy(p, &v, 2);
+	return p + 2;
+}
+
+static uint8_t* put_data(uint8_t* p, const void* data, size_t len)
+{
+	memcpy(p, data, len);
+	memset(p + len, 0, PAD4(len) - len);
+	return p + PAD4(len);
+}
+
+bool capture_open(const char* file)
+{
+	struct timespec ts;
+
+	cap_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (cap_fd < 0) {
+		LOG_ERR("Could not open capture '%s': %s", file, strerror(errno));
+		return false;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	real_start = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	mono_start = time_us();
+
+	/* section header block, byte order of this machine */
+	uint8_t* p = capture_reserve(28);
+	p = put32(p, PCAPNG_SHB);
+	p = put32(p, 28);
+	p = put32(p, PCAPNG_MAGIC);
+	p = put16(p, 1);
+	p = put16(p, 0);
+	p = put32(p, 0xFFFFFFFF); /* section length unknown */
+	p = put32(p, 0xFFFFFFFF);
+	put32(p, 28);
+	return true;
+}
+
+int capture_add_port(const char* name)
+{
+	if (cap_fd < 0) {
+		return -1;
+	}
+
+	size_t nlen = strlen(name);
+	uint32_t len = 20 + 4 + PAD4(nlen) + 4;
+	uint8_t* p = capture_reserve(len);
+	if (p == NULL) {
+		return -1;
+	}
+
+	p = put32(p, PCAPNG_IDB);
+	p = put32(p, len);
+	p = put16(p, CAPTURE_LINKTYPE);
+	p = put16(p, 0);
+	p = put32(p, 0); /* no snap length */
+	p = put16(p, PCAPNG_IF_NAME);
+	p = put16(p, nlen);
+	p = put_data(p, name, nlen);
+	p = put32(p, PCAPNG_OPT_END);
+	put32(p, len);
+	return num_intf++;
+}
+
+void capture_frame(int intf, enum capture_dir dir, const uint8_t* hdr,
+				   size_t hlen, const uint8_t* data, size_t len)
+{
+	if (cap_fd < 0 || intf < 0) {
+		return;
+	}
+
+	uint64_t ts = real_start + time_us() - mono_start;
+	size_t flen = hlen + len;
+	uint32_t blen = 28 + PAD4(flen) + 8 + 4 + 4;
+	uint8_t* p = capture_reserve(blen);
+	if (p == NULL) {
+		return;
+	}
+
+	p = put32(p, PCAPNG_EPB);
+	p = put32(p, blen);
+	p = put32(p, intf);
+	p = put32(p, ts >> 32);
+	p = put32(p, ts & 0xFFFFFFFF);
+	p = put32(p, flen);
+	p = put32(p, flen);
+	if (hlen > 0) {
+		memcpy(p, hdr, hlen);
+	}
+	memcpy(p + hlen, data, len);
+	memset(p + flen, 0, PAD4(flen) - flen);
+	p += PAD4(flen);
+	p = put16(p, PCAPNG_EPB_FLAGS);
+	p = put16(p, 4);
+	p = put32(p, dir);
+	p = put32(p, PCAPNG_OPT_END);
+	put32(p, blen);
+}
+
+void capture_close(void)
+{
+	if (cap_fd < 0) {
+		return;
+	}
+	capture_flush();
+	close(cap_fd);
+	cap_fd = -1;
+	num_intf = 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* --capture: DFU frames as they are sent and received, without SLIP, in a
+ * pcapng file. Every port is an interface with its name, the direction is
+ * in the packet flags and the link type is USER0 (147). On BLE data
+ * packets get the write opcode in front like on serial */
+
+#define CAPTURE_LINKTYPE 147
+
+enum capture_dir {
+	CAPTURE_RX = 1, /* inbound, as in the pcapng flags */
+	CAPTURE_TX = 2,
+};
+
+bool capture_open(const char* file);
+/* returns the interface id for capture_frame(), -1 when not capturing */
+int capture_add_port(const char* name);
+/* frame of hdr and data */
+void capture_frame(int intf, enum capture_dir dir, const uint8_t* hdr,
+				   size_t hlen, const uint8_t* data, size_t len);
+void capture_close(void);
+
+#endif
@@ -34,16 +34,26 @@ struct config {
 	int loglevel;
 	char* serport;
 	int serspeed;
+	int dfuspeed;
 	bool ser_acm;
 	char* zipfile;
 	char* dfucmd;
 	bool dfucmd_hex;
 	int timeout;
+	int prn;
+	char* metrics_file;
+	char* prom_file;
+	char* capture_file;
+	char* cache_dir;
+	bool force;
 	enum DFU_TYPE dfu_type;
 	char* interface;
 	char* ble_addr;
 	enum BLE_ATYPE ble_atype;
 	char* ble_passkey;
+	bool fleet;
+	char** ports;
+	int nports;
 };
 
 extern struct config conf;
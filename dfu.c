@@ -23,26 +23,35 @@
 #include <endian.h>
 #endif
 
+#include <stdlib.h>
+#include <string.h>
 #include <zlib.h>
 
+#include "capture.h"
 #include "conf.h"
 #include "dfu.h"
-#include "dfu_ble.h"
+#include "dfu_proto.h"
 #include "dfu_serial.h"
+#include "dfu_transport.h"
+#include "initpkt.h"
 #include "log.h"
+#include "metrics.h"
 #include "nrf_dfu_handling_error.h"
 #include "nrf_dfu_req_handler.h"
+#include "progress.h"
+#include "prom.h"
 #include "util.h"
 
-/* Timeout on Serial in seconds */
-#define SER_TIMEOUT_DEFAULT 1
-#define SER_TIMEOUT_OBJ_EXE 10
+/* object data packets which are written at once */
+#define WRITE_CHUNK_PKTS 16
 
-static uint16_t dfu_mtu;
-static uint32_t dfu_max_size;
-static uint32_t dfu_current_crc;
+static struct dfu_proto proto;
+static const struct dfu_transport* tp;
+static struct progress* prog;
+static int cap_intf = -1;
+static uint64_t req_time; /* us, when the last request was sent */
 
-static size_t request_size(nrf_dfu_request_t* req)
+size_t dfu_request_size(nrf_dfu_request_t* req)
 {
 	switch (req->request) {
 	case NRF_DFU_OP_OBJECT_CREATE:
@@ -73,20 +82,18 @@ static size_t request_size(nrf_dfu_request_t* req)
 
 static bool send_request(nrf_dfu_request_t* req)
 {
-	size_t size = request_size(req);
+	size_t size = dfu_request_size(req);
 	if (size == 0) {
 		LOG_ERR("Unknown size");
 		return false;
 	}
 
-	if (conf.dfu_type == DFU_SERIAL) {
-		return ser_encode_write((uint8_t*)req, size, SER_TIMEOUT_DEFAULT);
-	} else {
-		return ble_write_ctrl((uint8_t*)req, size);
-	}
+	req_time = time_us();
+	capture_frame(cap_intf, CAPTURE_TX, NULL, 0, (const uint8_t*)req, size);
+	return tp->write_ctrl((const uint8_t*)req, size);
 }
 
-static const char* dfu_err_str(nrf_dfu_result_t res)
+const char* dfu_err_str(nrf_dfu_result_t res)
 {
 	switch (res) {
 	case NRF_DFU_RES_CODE_INVALID:
@@ -118,7 +125,7 @@ static const char* dfu_err_str(nrf_dfu_result_t res)
 	return "Unknown error";
 }
 
-static const char* dfu_ext_err_str(nrf_dfu_ext_error_code_t res)
+const char* dfu_ext_err_str(nrf_dfu_ext_error_code_t res)
 {
 	switch (res) {
 	case NRF_DFU_EXT_ERROR_NO_ERROR:
@@ -174,20 +181,40 @@ static const char* dfu_ext_err_str(nrf_dfu_ext_error_code_t res)
 	return "Unknown extended error";
 }
 
+static const uint8_t* read_response(void)
+{
+	const uint8_t* buf;
+	size_t len = 0;
+
+	buf = tp->read(RESP_TIMEOUT_DEFAULT, &len);
+
+	if (buf) {
+		capture_frame(cap_intf, CAPTURE_RX, NULL, 0, buf, len);
+	}
+	return buf;
+}
+
 static nrf_dfu_response_t* get_response(nrf_dfu_op_t request)
 {
-	const uint8_t* buf = NULL;
-	if (conf.dfu_type == DFU_SERIAL) {
-		/* object execute needs more time when updating bootloader/SD */
-		buf = ser_read_decode(request == NRF_DFU_OP_OBJECT_EXECUTE
-								  ? SER_TIMEOUT_OBJ_EXE
-								  : SER_TIMEOUT_DEFAULT);
-	} else {
-		buf = ble_read();
+	const uint8_t* buf = read_response();
+
+	/* a late packet receipt notification of an aborted object write may
+	 * still be queued in front of the response we are waiting for. Before
+	 * the first ping is answered, so may responses of an aborted run */
+	while (buf && request != NRF_DFU_OP_OBJECT_WRITE
+		   && buf[0] == NRF_DFU_OP_RESPONSE
+		   && (buf[1] == NRF_DFU_OP_OBJECT_WRITE
+			   || (request == NRF_DFU_OP_PING && buf[1] != request))) {
+		LOG_DBG("Skipping stale response 0x%x", buf[1]);
+		buf = read_response();
 	}
 
 	if (!buf) {
-		/* error printed in function above */
+		/* error printed in function above. Pings are expected to go
+		 * unanswered while the device boots */
+		if (request != NRF_DFU_OP_PING && !tp->stopped()) {
+			metrics_count(MC_TIMEOUTS, 1);
+		}
 		return NULL;
 	}
 
@@ -204,6 +231,10 @@ static nrf_dfu_response_t* get_response(nrf_dfu_op_t request)
 		return NULL;
 	}
 
+	/* notifications are not answers to a request */
+	if (request != NRF_DFU_OP_OBJECT_WRITE) {
+		metrics_latency(request, time_us() - req_time);
+	}
 	return resp;
 }
 
@@ -240,6 +271,12 @@ bool dfu_ping(void)
 	}
 
 	nrf_dfu_response_t* resp = get_response(req.request);
+	/* answers to earlier pings come late, wait for the answer to this one */
+	while (resp && resp->result == NRF_DFU_RES_CODE_SUCCESS
+		   && resp->ping.id != req.ping.id) {
+		LOG_DBG("Skipping answer to ping %d", resp->ping.id);
+		resp = get_response(req.request);
+	}
 	if (response_is_error(resp)) {
 		return false;
 	}
@@ -252,27 +289,6 @@ bool dfu_ping(void)
 	return (resp->ping.id == ping_id - 1);
 }
 
-static bool dfu_set_packet_receive_notification(uint16_t prn)
-{
-	LOG_INF_("Set packet receive notification %d: ", prn);
-	nrf_dfu_request_t req = {
-		.request = NRF_DFU_OP_RECEIPT_NOTIF_SET,
-		.prn.target = htole16(prn),
-	};
-
-	if (!send_request(&req)) {
-		return false;
-	}
-
-	nrf_dfu_response_t* resp = get_response(req.request);
-	if (response_is_error(resp)) {
-		return false;
-	}
-
-	LOG_INF("OK");
-	return true;
-}
-
 /* serial only */
 static bool dfu_get_serial_mtu(void)
 {
@@ -290,49 +306,35 @@ static bool dfu_get_serial_mtu(void)
 		return false;
 	}
 
-	dfu_mtu = le16toh(resp->mtu.size);
-	if (dfu_mtu > SLIP_BUF_SIZE) {
-		LOG_WARN("MTU of %d limited to buffer size %d", dfu_mtu, SLIP_BUF_SIZE);
-		dfu_mtu = SLIP_BUF_SIZE;
+	uint16_t mtu = le16toh(resp->mtu.size);
+	if (mtu > SLIP_BUF_SIZE) {
+		LOG_WARN("MTU of %d limited to buffer size %d", mtu, SLIP_BUF_SIZE);
+	}
+	proto.mtu = dfu_slip_mtu(mtu);
+	if (proto.mtu == 0) {
+		LOG_ERR("MTU %d too small", mtu);
+		return false;
 	}
-	/* use MTU without SLIP overhead */
-	LOG_INF("%d with SLIP => %d", dfu_mtu, (dfu_mtu - 1) / 2);
-	dfu_mtu = (dfu_mtu - 1) / 2;
+	LOG_INF("%d with SLIP => %d", mtu, proto.mtu);
 	return true;
 }
 
-static void dfu_set_mtu(uint16_t mtu)
+uint16_t dfu_slip_mtu(uint16_t size)
 {
-	dfu_mtu = mtu;
-}
-
-static uint32_t dfu_get_crc(void)
-{
-	LOG_INF_("Get CRC: ");
 	nrf_dfu_request_t req = {
-		.request = NRF_DFU_OP_CRC_GET,
+		.request = NRF_DFU_OP_OBJECT_CREATE,
 	};
 
-	if (!send_request(&req)) {
-		return 0;
-	}
-
-	nrf_dfu_response_t* resp = get_response(req.request);
-	if (response_is_error(resp)) {
-		return 0;
-	}
-
-	LOG_INF("0x%X (offset %u)", le32toh(resp->crc.crc),
-			le32toh(resp->crc.offset));
-	return le32toh(resp->crc.crc);
+	/* use MTU without SLIP overhead, the longest request has to fit */
+	size = (MIN(size, SLIP_BUF_SIZE) - 1) / 2;
+	return size >= dfu_request_size(&req) ? size : 0;
 }
 
-static bool dfu_object_select(uint8_t type, uint32_t* offset, uint32_t* crc)
+bool dfu_hw_version(nrf_dfu_response_hardware_t* hw)
 {
-	LOG_INF_("Select object %d: ", type);
+	LOG_INF_("Get hardware version: ");
 	nrf_dfu_request_t req = {
-		.request = NRF_DFU_OP_OBJECT_SELECT,
-		.select.object_type = type,
+		.request = NRF_DFU_OP_HARDWARE_VERSION,
 	};
 
 	if (!send_request(&req)) {
@@ -344,270 +346,197 @@ static bool dfu_object_select(uint8_t type, uint32_t* offset, uint32_t* crc)
 		return false;
 	}
 
-	dfu_max_size = le32toh(resp->select.max_size);
-	*offset = le32toh(resp->select.offset);
-	*crc = le32toh(resp->select.crc);
-	LOG_INF("offset %u max_size %u CRC 0x%X", *offset, dfu_max_size, *crc);
+	hw->part = le32toh(resp->hardware.part);
+	hw->variant = le32toh(resp->hardware.variant);
+	hw->memory.rom_size = le32toh(resp->hardware.memory.rom_size);
+	hw->memory.ram_size = le32toh(resp->hardware.memory.ram_size);
+	hw->memory.rom_page_size = le32toh(resp->hardware.memory.rom_page_size);
+	LOG_INF("part 0x%X variant 0x%X ROM %u RAM %u", hw->part, hw->variant,
+			hw->memory.rom_size, hw->memory.ram_size);
 	return true;
 }
 
-static bool dfu_object_create(uint8_t type, uint32_t size)
+bool dfu_fw_current(const char* port, const struct dfu_image* img,
+					const nrf_dfu_response_firmware_t* fw, int num_fw)
 {
-	LOG_INF_("Create object %d (size %u): ", type, size);
-	nrf_dfu_request_t req = {
-		.request = NRF_DFU_OP_OBJECT_CREATE,
-		.create.object_type = type,
-		.create.object_size = htole32(size),
-	};
+	struct init_packet ip;
 
-	if (!send_request(&req)) {
+	if (num_fw == 0) {
 		return false;
 	}
 
-	nrf_dfu_response_t* resp = get_response(req.request);
-	if (response_is_error(resp)) {
+	if (!init_packet_parse(img->dat, img->dat_size, &ip)) {
+		LOG_WARN("%s%sCan't decode init packet of %s", port ? port : "",
+				 port ? ": " : "", img->name);
 		return false;
 	}
 
-	LOG_INF("OK");
-	return true;
-}
+	/* debug packages are accepted with any version and a SoftDevice has
+	 * no version which could be compared */
+	if (!ip.has_fw_version || ip.fw_version == UINT32_MAX || ip.is_debug
+		|| (ip.type != IFT_APPLICATION && ip.type != IFT_BOOTLOADER)) {
+		return false;
+	}
 
-static bool dfu_object_write(zip_file_t* zf, size_t size)
-{
-	uint8_t buf[dfu_mtu];
-	uint8_t* fbuf = buf;
-	size_t written = 0;
-	zip_int64_t len;
-	size_t to_read;
-
-	LOG_INF_("Write data (size %zd MTU %d): ", size, dfu_mtu);
-
-	do {
-		if (conf.dfu_type == DFU_SERIAL) {
-			/* we need to put the write command first, so that leaves one
-			 * byte less for data */
-			buf[0] = NRF_DFU_OP_OBJECT_WRITE;
-			fbuf = buf + 1;
-			to_read = MIN(sizeof(buf) - 1, size - written);
-		} else {
-			to_read = MIN(sizeof(buf), size - written);
-		}
-		len = zip_fread(zf, fbuf, to_read);
-		if (len < 0) {
-			LOG_ERR("zip_fread error");
-			break;
-		}
-		if (len == 0) { // EOF
-			break;
+	for (int i = 0; i < num_fw; i++) {
+		uint32_t version = le32toh(fw[i].version);
+		if (ip.type == IFT_APPLICATION
+			&& fw[i].type == NRF_DFU_FIRMWARE_TYPE_APPLICATION) {
+			/* the same version may be rebuilt, so compare the size too */
+			return version == ip.fw_version
+				   && le32toh(fw[i].len) == img->bin_size;
 		}
-		bool b;
-		if (conf.dfu_type == DFU_SERIAL) {
-			b = ser_encode_write(buf, len + 1, SER_TIMEOUT_DEFAULT);
-		} else {
-			b = ble_write_data(fbuf, len);
-		}
-		if (!b) {
-			LOG_ERR("write failed");
-			return false;
+		if (ip.type == IFT_BOOTLOADER
+			&& fw[i].type == NRF_DFU_FIRMWARE_TYPE_BOOTLOADER) {
+			/* the bootloader would refuse the same or a lower version */
+			return version >= ip.fw_version;
 		}
-		written += len;
-		dfu_current_crc = crc32(dfu_current_crc, fbuf, len);
-	} while (len > 0 && written < size && written < dfu_max_size);
-
-	// No response expected
-	LOG_INF("%zd bytes CRC: 0x%X", written, dfu_current_crc);
-
-	if (conf.loglevel < LL_INFO) {
-		printf(".");
-		fflush(stdout);
 	}
-
-	return true;
+	return false;
 }
 
-/** this writes the object to flash
- * return: failed, success, fw_version too low */
-static enum dfu_ret dfu_object_execute(void)
+uint32_t* dfu_crc_table(const uint8_t* data, size_t size)
 {
-	LOG_INF_("Object Execute: ");
-	nrf_dfu_request_t req = {
-		.request = NRF_DFU_OP_OBJECT_EXECUTE,
-	};
-
-	if (!send_request(&req)) {
-		return DFU_RET_ERROR;
+	size_t num = size / DFU_CRC_STEP + 1;
+	uint32_t* crcs = malloc(num * sizeof(*crcs));
+	if (crcs == NULL) {
+		return NULL;
 	}
 
-	nrf_dfu_response_t* resp = get_response(req.request);
-	if (response_is_error(resp)) {
-		if (resp && resp->result == NRF_DFU_RES_CODE_EXT_ERROR
-			&& resp->ext_err == NRF_DFU_EXT_ERROR_FW_VERSION_FAILURE) {
-			return DFU_RET_FW_VERSION;
-		} else {
-			return DFU_RET_ERROR;
-		}
+	crcs[0] = crc32(0L, Z_NULL, 0);
+	for (size_t i = 1; i < num; i++) {
+		crcs[i] = crc32(crcs[i - 1], data + (i - 1) * DFU_CRC_STEP,
+						DFU_CRC_STEP);
 	}
+	return crcs;
+}
 
-	LOG_INF("OK");
-	return DFU_RET_SUCCESS;
+/* continue from the nearest prefix, so this never covers more than
+ * DFU_CRC_STEP bytes */
+uint32_t dfu_crc_at(const uint8_t* data, const uint32_t* crcs, size_t offset)
+{
+	size_t i = offset / DFU_CRC_STEP;
+	return crc32(crcs[i], data + i * DFU_CRC_STEP, offset % DFU_CRC_STEP);
 }
 
-/* get CRC of contents of ZIP file until size */
-static uint32_t zip_crc_move(zip_file_t* zf, size_t size)
+void dfu_set_transport(const struct dfu_transport* t)
 {
-	uint8_t fbuf[200];
-	size_t read = 0;
-	size_t to_read;
-	zip_int64_t len;
-	uint32_t crc = crc32(0L, Z_NULL, 0);
-
-	do {
-		to_read = MIN(sizeof(fbuf), size - read);
-		len = zip_fread(zf, fbuf, to_read);
-		if (len < 0) {
-			LOG_ERR("zip_fread error");
-			break;
-		}
-		if (len == 0) { // EOF
-			break;
-		}
-		read += len;
-		crc = crc32(crc, fbuf, len);
-	} while (len > 0 && read < size);
+	tp = t;
+}
 
-	return crc;
+void dfu_set_progress(struct progress* p)
+{
+	prog = p;
 }
 
-/** return: failed, success, fw_version too low */
-static enum dfu_ret dfu_object_write_procedure(uint8_t type, zip_file_t* zf,
-											   size_t sz)
+void dfu_set_capture(int intf)
 {
-	uint32_t offset;
-	uint32_t crc;
-	enum dfu_ret ret;
-
-	if (!dfu_object_select(type, &offset, &crc)) {
-		return DFU_RET_ERROR;
-	}
-
-	/* object with same length and CRC already received */
-	if (offset == sz && zip_crc_move(zf, sz) == crc) {
-		LOG_NOTI_("Object already received");
-		/* Don't transfer anything and skip to the Execute command */
-		return dfu_object_execute();
-	}
-
-	/* parts already received */
-	if (offset > 0) {
-		uint32_t remain = offset % dfu_max_size;
-		LOG_WARN("Object partially received (offset %u remaining %u)", offset,
-				 remain);
-
-		dfu_current_crc = zip_crc_move(zf, offset);
-		if (crc != dfu_current_crc) {
-			/* invalid crc, remove corrupted data, rewind and
-			 * create new object below */
-			offset -= remain > 0 ? remain : dfu_max_size;
-			LOG_WARN("CRC does not match (restarting from %u)", offset);
-			zip_fseek(zf, 0, 0);
-			dfu_current_crc = zip_crc_move(zf, offset);
-		} else if (offset < sz) { /* CRC matches */
-			/* transfer remaining data if necessary */
-			if (remain > 0) {
-				size_t end = offset + dfu_max_size - remain;
-				if (!dfu_object_write(zf, end)) {
-					return DFU_RET_ERROR;
-				}
-			}
-			ret = dfu_object_execute();
-			if (ret != DFU_RET_SUCCESS) {
-				return ret;
-			}
-		}
-	} else if (offset == 0) {
-		dfu_current_crc = crc32(0L, Z_NULL, 0);
+	cap_intf = intf;
+}
+
+static bool proto_write_ctrl(__attribute__((unused)) void* ctx,
+							 const uint8_t* req, size_t len)
+{
+	/* object data queued before goes first */
+	if (tp->flush && !tp->flush()) {
+		return false;
 	}
+	capture_frame(cap_intf, CAPTURE_TX, NULL, 0, req, len);
+	return tp->write_ctrl(req, len);
+}
 
-	/* create and write objects of max_size */
-	for (int i = offset; i < sz; i += dfu_max_size) {
-		size_t osz = MIN(sz - i, dfu_max_size);
-		if (!dfu_object_create(type, osz)) {
-			return DFU_RET_ERROR;
-		}
+static const uint8_t write_op = NRF_DFU_OP_OBJECT_WRITE;
 
-		if (!dfu_object_write(zf, osz)) {
-			return DFU_RET_ERROR;
-		}
+static bool proto_write_data(__attribute__((unused)) void* ctx,
+							 const uint8_t* data, size_t len)
+{
+	capture_frame(cap_intf, CAPTURE_TX, &write_op, 1, data, len);
+	return tp->write_data(data, len);
+}
 
-		uint32_t rcrc = dfu_get_crc();
-		if (rcrc != dfu_current_crc) {
-			LOG_ERR("CRC failed 0x%X vs 0x%X", rcrc, dfu_current_crc);
-			return DFU_RET_ERROR;
-		}
+static const struct dfu_proto_ops proto_ops = {
+	.write_ctrl = proto_write_ctrl,
+	.write_data = proto_write_data,
+};
 
-		ret = dfu_object_execute();
-		if (ret != DFU_RET_SUCCESS) {
-			return ret;
-		}
+/* feed the next frame or the timeout to the protocol */
+static void proto_read(void)
+{
+	size_t len = 0;
+	const uint8_t* buf = tp->read(dfu_proto_timeout_ms(&proto), &len);
+
+	if (buf) {
+		capture_frame(cap_intf, CAPTURE_RX, NULL, 0, buf, len);
+		dfu_proto_response(&proto, buf, len);
+	} else if (tp->stopped()) {
+		/* Ctrl-C, not a timeout to count or retry */
+		dfu_proto_fail(&proto, DFU_RET_ERROR, "Interrupted");
+	} else {
+		dfu_proto_timeout(&proto);
 	}
-
-	return DFU_RET_SUCCESS;
 }
 
 bool dfu_bootloader_enter(void)
 {
-	if (conf.dfu_type == DFU_SERIAL) {
-		if (!ser_enter_dfu()) {
-			return false;
-		}
-		if (!dfu_get_serial_mtu()) {
-			return false;
-		}
-	} else {
-		int e = ble_enter_dfu(conf.interface, conf.ble_addr, conf.ble_atype);
-		if (!e) {
-			return false;
-		}
+	dfu_proto_init(&proto, &proto_ops, NULL, NULL, prog);
+	proto.data_header = tp->data_header;
+	proto.dots = true;
+	/* without polling for notifications, wait at every window */
+	proto.max_pending = tp->read_pending ? PRN_MAX_PENDING : 0;
 
-		/* Normally the device entered the bootloader and is now available as
-		 * as DfuTarg with a MAC address + 1 and we need to connect to it.
-		 * In the special case that we we already connected to the bootloader
-		 * above, this is detected and ble_enter_dfu() returns 2. */
-		if (e != 2) {
-			if (!ble_connect_dfu_targ(conf.interface, conf.ble_addr,
-									  conf.ble_atype)) {
-				return false;
-			}
-		}
+	if (!tp->enter()) {
+		return false;
+	}
 
-		dfu_set_mtu(244);
+	if (tp->mtu) {
+		proto.mtu = tp->mtu;
+	} else if (!dfu_get_serial_mtu()) {
+		return false;
 	}
 	return true;
 }
 
-/** return: failed, success, fw_version too low */
-enum dfu_ret dfu_upgrade(zip_file_t* init_zip, size_t init_size,
-						 zip_file_t* fw_zip, size_t fw_size)
+/** run the procedure of dfu_proto.c, waiting for each response
+ * return: failed, success, fw_version too low, already current */
+enum dfu_ret dfu_upgrade(const struct dfu_image* img)
 {
-	if (!dfu_set_packet_receive_notification(0)) {
-		return DFU_RET_ERROR;
-	}
+	dfu_proto_start(&proto, img);
+
+	while (!dfu_proto_finished(&proto)) {
+		if (!dfu_proto_can_write(&proto)) {
+			proto_read();
+			continue;
+		}
+
+		dfu_proto_fill(&proto, WRITE_CHUNK_PKTS);
+		/* all packets of this chunk at once */
+		if (tp->flush && !tp->flush()) {
+			dfu_proto_fail(&proto, DFU_RET_ERROR,
+						   tp->stopped() ? "Interrupted" : "write failed");
+		}
+		prom_tick();
 
-	LOG_NOTI_("Sending Init: ");
-	enum dfu_ret ret = dfu_object_write_procedure(1, init_zip, init_size);
-	if (ret != DFU_RET_SUCCESS) {
-		return ret;
+		/* check notifications which already arrived */
+		while (!dfu_proto_finished(&proto) && proto.prn_npending > 0
+			   && tp->read_pending && tp->read_pending()) {
+			proto_read();
+		}
 	}
-	LOG_NL(LL_NOTICE);
 
-	LOG_NOTI_("Sending Data: ");
-	ret = dfu_object_write_procedure(2, fw_zip, fw_size);
-	if (ret != DFU_RET_SUCCESS) {
-		return ret;
+	if (proto.state == DP_FAILED) {
+		LOG_NL(LL_NOTICE);
+		LOG_ERR("%s", proto.error);
 	}
+	return proto.ret;
+}
+
+void dfu_abort(void)
+{
+	LOG_INF("Abort");
+	nrf_dfu_request_t req = {
+		.request = NRF_DFU_OP_ABORT,
+	};
 
-	LOG_NL(LL_NOTICE);
-	LOG_NOTI("Done");
-	return DFU_RET_SUCCESS;
+	/* the bootloader resets, maybe before answering */
+	send_request(&req);
 }
@@ -22,13 +22,64 @@
 
 #include <stdbool.h>
 #include <stddef.h>
-#include <zip.h>
+#include <stdint.h>
 
-enum dfu_ret { DFU_RET_SUCCESS, DFU_RET_ERROR, DFU_RET_FW_VERSION };
+#include "nrf_dfu_handling_error.h"
+#include "nrf_dfu_req_handler.h"
 
+enum dfu_ret {
+	DFU_RET_SUCCESS,
+	DFU_RET_ERROR,
+	DFU_RET_FW_VERSION,
+	DFU_RET_CURRENT, /* device already runs the image, nothing sent */
+};
+
+/* images reported by FIRMWARE_VERSION: bootloader, SoftDevice, application */
+#define DFU_MAX_FW 4
+
+/* distance of the CRC prefixes in struct dfu_image */
+#define DFU_CRC_STEP 512
+
+/* image decompressed into memory, shared read-only by all sessions. The CRC
+ * tables hold the CRC32 of the first i * DFU_CRC_STEP bytes */
+struct dfu_image {
+	const char* name;
+	uint8_t* dat;
+	size_t dat_size;
+	uint32_t* dat_crcs;
+	uint8_t* bin;
+	size_t bin_size;
+	uint32_t* bin_crcs;
+};
+
+struct dfu_transport;
+struct progress;
+
+size_t dfu_request_size(nrf_dfu_request_t* req);
+const char* dfu_err_str(nrf_dfu_result_t res);
+const char* dfu_ext_err_str(nrf_dfu_ext_error_code_t res);
+
+void dfu_set_transport(const struct dfu_transport* t);
+void dfu_set_progress(struct progress* p);
+/* interface for capture_frame() */
+void dfu_set_capture(int intf);
+/* CRC prefix table of data, has to be freed by caller */
+uint32_t* dfu_crc_table(const uint8_t* data, size_t size);
+/* CRC32 of the first offset bytes of data */
+uint32_t dfu_crc_at(const uint8_t* data, const uint32_t* crcs, size_t offset);
+/* true if one of the device images in fw is the same as img. port prefixes
+ * the log, NULL for none */
+bool dfu_fw_current(const char* port, const struct dfu_image* img,
+					const nrf_dfu_response_firmware_t* fw, int num_fw);
 bool dfu_ping(void);
+/* packet size for the MTU a serial bootloader reports, which includes the
+ * SLIP encoding. 0 if requests don't fit */
+uint16_t dfu_slip_mtu(uint16_t size);
+/* part and variant from the FICR of the device, in host byte order */
+bool dfu_hw_version(nrf_dfu_response_hardware_t* hw);
 bool dfu_bootloader_enter(void);
-enum dfu_ret dfu_upgrade(zip_file_t* init_zip, size_t init_size,
-						 zip_file_t* fw_zip, size_t fw_size);
+enum dfu_ret dfu_upgrade(const struct dfu_image* img);
+/* leave the bootloader when nothing was updated */
+void dfu_abort(void);
 
 #endif
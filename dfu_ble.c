@@ -17,15 +17,21 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "conf.h"
 #include "dfu_ble.h"
+#include "dfu_transport.h"
 #include "log.h"
 #include "util.h"
 
+/* length of the last control point notification */
+static size_t recv_len;
+static volatile sig_atomic_t terminate;
+
 #ifndef BLE_SUPPORT
 
 int ble_enter_dfu(const char* interface, const char* address,
@@ -72,7 +78,6 @@ void ble_wait_disconnect(int ms)
 #define CONNECT_NORMAL_TRY	 3
 #define CONNECT_DFUTARG_TRY	 10
 
-static bool terminate = false;
 static bool buttonless_noti = false;
 static bool control_noti = false;
 static bool disconnect_noti = false;
@@ -97,10 +102,11 @@ void buttonless_notify_handler(const uint8_t* data, size_t len, blz_char* ch,
 void control_notify_handler(const uint8_t* data, size_t len, blz_char* ch,
 							void* user)
 {
-	memcpy(recv_buf, data, len);
+	recv_len = MIN(len, sizeof(recv_buf));
+	memcpy(recv_buf, data, recv_len);
 	control_noti = true;
 
-	if (conf.loglevel >= LL_DEBUG) {
+	if (LOG_ENABLED(LL_DEBUG)) {
 		dump_data("RX: ", data, len);
 	}
 }
@@ -282,7 +288,7 @@ bool ble_connect_dfu_targ(const char* interface, const char* address,
 
 bool ble_write_ctrl(uint8_t* req, size_t len)
 {
-	if (conf.loglevel >= LL_DEBUG) {
+	if (LOG_ENABLED(LL_DEBUG)) {
 		dump_data("CP: ", req, len);
 	}
 	blz_ret r = blz_char_write(cp, req, len);
@@ -295,7 +301,7 @@ bool ble_write_ctrl(uint8_t* req, size_t len)
 
 bool ble_write_data(uint8_t* req, size_t len)
 {
-	if (conf.loglevel >= LL_DEBUG) {
+	if (LOG_ENABLED(LL_DEBUG)) {
 		dump_data("TX: ", req, len);
 	}
 	blz_ret r = blz_char_write_cmd(dp, req, len);
@@ -360,3 +366,73 @@ void ble_wait_disconnect(int ms)
 }
 
 #endif
+
+static bool ble_enter(void)
+{
+	int e = ble_enter_dfu(conf.interface, conf.ble_addr, conf.ble_atype);
+	if (!e) {
+		return false;
+	}
+
+	/* Normally the device entered the bootloader and is now available as
+	 * as DfuTarg with a MAC address + 1 and we need to connect to it.
+	 * In the special case that we we already connected to the bootloader
+	 * above, this is detected and ble_enter_dfu() returns 2. */
+	if (e != 2) {
+		return ble_connect_dfu_targ(conf.interface, conf.ble_addr,
+									conf.ble_atype);
+	}
+	return true;
+}
+
+static bool ble_reenter(void)
+{
+	/* wait until bootloader disconnect while updating BL+SD */
+	ble_wait_disconnect(10000);
+	/* connect to BL again, if that fails, it may be that the APP is already
+	 * running, try to connect normally */
+	return ble_connect_dfu_targ(conf.interface, conf.ble_addr, conf.ble_atype)
+		   || ble_enter();
+}
+
+static bool ble_write_ctrl_tp(const uint8_t* req, size_t len)
+{
+	return !terminate && ble_write_ctrl((uint8_t*)req, len);
+}
+
+static bool ble_write_data_tp(const uint8_t* data, size_t len)
+{
+	return !terminate && ble_write_data((uint8_t*)data, len);
+}
+
+static void ble_stop(void)
+{
+	terminate = true;
+}
+
+static bool ble_stopped(void)
+{
+	return terminate;
+}
+
+/* notifications have their own timeout */
+static const uint8_t* ble_read_tp(__attribute__((unused)) int timeout_ms,
+								 size_t* len)
+{
+	const uint8_t* buf = ble_read();
+	*len = recv_len;
+	return buf;
+}
+
+const struct dfu_transport dfu_ble_transport = {
+	.name = "BLE",
+	.mtu = 244,
+	.enter = ble_enter,
+	.reenter = ble_reenter,
+	.write_ctrl = ble_write_ctrl_tp,
+	.write_data = ble_write_data_tp,
+	.read = ble_read_tp,
+	.stop = ble_stop,
+	.stopped = ble_stopped,
+	.close = ble_fini,
+};
@@ -0,0 +1,534 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef __APPLE__
+#include "mac_endian.h"
+#else
+#include <endian.h>
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "conf.h"
+#include "dfu_proto.h"
+#include "log.h"
+#include "metrics.h"
+#include "progress.h"
+#include "util.h"
+
+/* log with the port in front in fleet mode */
+#define PROTO_LOG(lvl, p, fmt, ...)                                            \
+	LOG_AT(lvl, true, "%s%s" fmt, (p)->port ? (p)->port : "",                  \
+		   (p)->port ? ": " : "", ##__VA_ARGS__)
+
+void dfu_proto_fail(struct dfu_proto* p, enum dfu_ret ret, const char* fmt,
+					...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(p->error, sizeof(p->error), fmt, args);
+	va_end(args);
+
+	p->state = DP_FAILED;
+	p->ret = ret;
+}
+
+bool dfu_proto_finished(const struct dfu_proto* p)
+{
+	return p->state == DP_DONE || p->state == DP_FAILED;
+}
+
+static void proto_done(struct dfu_proto* p, enum dfu_ret ret)
+{
+	p->state = DP_DONE;
+	p->ret = ret;
+}
+
+static void proto_request(struct dfu_proto* p, nrf_dfu_request_t* req,
+						  enum dfu_proto_state state)
+{
+	p->req = req->request;
+	p->req_time = time_us();
+	p->state = state;
+	if (!p->ops->write_ctrl(p->ctx, (const uint8_t*)req,
+							dfu_request_size(req))) {
+		dfu_proto_fail(p, DFU_RET_ERROR, "write failed");
+	}
+}
+
+int dfu_proto_timeout_ms(const struct dfu_proto* p)
+{
+	switch (p->req) {
+	case NRF_DFU_OP_OBJECT_EXECUTE:
+		/* needs more time when updating bootloader/SD */
+		return RESP_TIMEOUT_OBJ_EXE;
+	case NRF_DFU_OP_OBJECT_CREATE:
+		/* flash is erased before the response */
+		return RESP_TIMEOUT_OBJ_CREATE;
+	default:
+		return RESP_TIMEOUT_DEFAULT;
+	}
+}
+
+static void proto_fw_version(struct dfu_proto* p)
+{
+	nrf_dfu_request_t req = {
+		.request = NRF_DFU_OP_FIRMWARE_VERSION,
+		.firmware.image_number = p->num_fw,
+	};
+	proto_request(p, &req, DP_FW_VERSION);
+}
+
+static void proto_select(struct dfu_proto* p, uint8_t type)
+{
+	const struct dfu_image* img = p->img;
+
+	p->type = type;
+	p->data = type == 1 ? img->dat : img->bin;
+	p->crcs = type == 1 ? img->dat_crcs : img->bin_crcs;
+	p->size = type == 1 ? img->dat_size : img->bin_size;
+	p->tries = 0;
+	progress_phase(p->progress, type == 1 ? "init" : "data", img->name,
+				   p->size);
+	if (p->dots) {
+		if (type == 2) {
+			LOG_NL(LL_NOTICE);
+		}
+		LOG_NOTI_(type == 1 ? "Sending Init: " : "Sending Data: ");
+	}
+
+	nrf_dfu_request_t req = {
+		.request = NRF_DFU_OP_OBJECT_SELECT,
+		.select.object_type = type,
+	};
+	proto_request(p, &req, DP_SELECT);
+}
+
+/* start sending the image, unless the device already runs it */
+static void proto_image(struct dfu_proto* p)
+{
+	if (dfu_fw_current(p->port, p->img, p->fw, p->num_fw)) {
+		metrics_count(MC_IMAGES_CURRENT, 1);
+		proto_done(p, DFU_RET_CURRENT);
+		return;
+	}
+	proto_select(p, 1);
+}
+
+static void proto_create(struct dfu_proto* p)
+{
+	p->obj_start = p->offset;
+	p->obj_start_crc = p->crc;
+	p->obj_end = MIN(p->offset + p->max_size, p->size);
+
+	PROTO_LOG(LL_INFO, p, "Create object %d (offset %u size %u)", p->type,
+			  p->offset, p->obj_end - p->offset);
+	nrf_dfu_request_t req = {
+		.request = NRF_DFU_OP_OBJECT_CREATE,
+		.create.object_type = p->type,
+		.create.object_size = htole32(p->obj_end - p->offset),
+	};
+	proto_request(p, &req, DP_CREATE);
+}
+
+static void proto_execute(struct dfu_proto* p)
+{
+	nrf_dfu_request_t req = {
+		.request = NRF_DFU_OP_OBJECT_EXECUTE,
+	};
+	proto_request(p, &req, DP_EXECUTE);
+}
+
+/* ask for the CRC once all data of the object is sent and all notifications
+ * are in */
+static void proto_written(struct dfu_proto* p)
+{
+	if (p->state != DP_WRITE || p->offset < p->obj_end
+		|| p->prn_npending > 0) {
+		return;
+	}
+
+	metrics_object(p->type, p->obj_start, p->obj_end - p->obj_start,
+				   time_us() - p->obj_time);
+	PROTO_LOG(LL_INFO, p, "Wrote %u bytes, CRC 0x%X", p->offset - p->obj_start,
+			  p->crc);
+	nrf_dfu_request_t req = {
+		.request = NRF_DFU_OP_CRC_GET,
+	};
+	proto_request(p, &req, DP_CRC);
+}
+
+/* When prn_sync is true, the object was just created and the packet receipt
+ * notifications, if enabled, are checked while sending on. Otherwise they are
+ * ignored. */
+static void proto_write(struct dfu_proto* p, bool prn_sync)
+{
+	p->state = DP_WRITE;
+	p->req = NRF_DFU_OP_OBJECT_WRITE;
+	p->prn_sync = prn_sync;
+	p->pkts = 0;
+	p->prn_npending = 0;
+	p->obj_time = time_us();
+	proto_written(p);
+}
+
+/* the bootloader appends the data it receives, so an object is the smallest
+ * unit which can be sent again */
+static void proto_retry(struct dfu_proto* p, const char* why)
+{
+	if (++p->tries >= OBJECT_TRIES) {
+		dfu_proto_fail(p, DFU_RET_ERROR, "%s", why);
+		return;
+	}
+
+	PROTO_LOG(LL_WARN, p, "%s, sending object at offset %u again", why,
+			  p->obj_start);
+	metrics_count(MC_OBJECT_RETRIES, 1);
+	p->offset = p->obj_start;
+	p->crc = p->obj_start_crc;
+	proto_create(p);
+}
+
+/* continue after the data the device already has */
+static void proto_resume(struct dfu_proto* p, uint32_t offset, uint32_t crc)
+{
+	if (offset > p->size) {
+		PROTO_LOG(LL_WARN, p, "Object offset %u beyond image (size %zu)",
+				  offset, p->size);
+		offset = 0;
+	}
+
+	uint32_t remain = offset % p->max_size;
+
+	/* object with same length and CRC already received: don't transfer
+	 * anything and skip to the Execute command */
+	if (offset == p->size && dfu_crc_at(p->data, p->crcs, offset) == crc) {
+		PROTO_LOG(LL_INFO, p, "Object already received");
+		metrics_count(MC_RESUME_SKIPPED, offset);
+		p->offset = offset;
+		p->crc = crc;
+		p->obj_start = offset
+					   - (remain > 0 ? remain : MIN(offset, p->max_size));
+		proto_execute(p);
+		return;
+	}
+
+	if (offset > 0 && dfu_crc_at(p->data, p->crcs, offset) != crc) {
+		/* remove corrupted data, rewind and create a new object */
+		offset -= remain > 0 ? remain : p->max_size;
+		PROTO_LOG(LL_WARN, p, "CRC does not match (restarting from %u)",
+				  offset);
+		metrics_count(MC_RESUME_SKIPPED, offset);
+		p->offset = offset;
+		p->crc = dfu_crc_at(p->data, p->crcs, offset);
+		proto_create(p);
+		return;
+	}
+
+	if (offset > 0) {
+		PROTO_LOG(LL_WARN, p,
+				  "Object partially received (offset %u remaining %u)", offset,
+				  remain);
+		metrics_count(MC_RESUME_SKIPPED, offset);
+	}
+	p->offset = offset;
+	p->crc = dfu_crc_at(p->data, p->crcs, offset);
+
+	if (offset == 0) {
+		proto_create(p);
+	} else if (remain > 0) {
+		/* transfer the rest of the object, it is sent again from its start
+		 * if the CRC doesn't match afterwards */
+		p->obj_start = offset - remain;
+		p->obj_start_crc = dfu_crc_at(p->data, p->crcs, p->obj_start);
+		p->obj_end = MIN(p->obj_start + p->max_size, p->size);
+		proto_write(p, false);
+	} else {
+		/* complete object, execute it and continue after it */
+		p->obj_start = offset - p->max_size;
+		proto_execute(p);
+	}
+}
+
+bool dfu_proto_can_write(const struct dfu_proto* p)
+{
+	return p->state == DP_WRITE && p->offset < p->obj_end
+		   && p->prn_npending <= p->max_pending;
+}
+
+void dfu_proto_fill(struct dfu_proto* p, int max_pkts)
+{
+	size_t pkt = p->mtu - p->data_header;
+	uint32_t start = p->offset;
+
+	for (int i = 0; i < max_pkts && dfu_proto_can_write(p); i++) {
+		const uint8_t* buf = p->data + p->offset;
+		size_t len = MIN(pkt, p->obj_end - p->offset);
+
+		if (!p->ops->write_data(p->ctx, buf, len)) {
+			dfu_proto_fail(p, DFU_RET_ERROR, "write failed");
+			return;
+		}
+		p->offset += len;
+		p->crc = crc32(p->crc, buf, len);
+
+		if (p->prn_sync && conf.prn > 0 && ++p->pkts % conf.prn == 0) {
+			p->prn_pending[p->prn_npending].offset = p->offset;
+			p->prn_pending[p->prn_npending].crc = p->crc;
+			p->prn_npending++;
+		}
+	}
+
+	metrics_count(MC_BYTES, p->offset - start);
+	progress_update(p->progress, p->obj_start / p->max_size, p->offset,
+					p->offset, false);
+	proto_written(p);
+}
+
+/* check the oldest outstanding packet receipt notification against the
+ * offset and CRC of the data we sent up to then */
+static void proto_prn(struct dfu_proto* p, const nrf_dfu_response_t* resp)
+{
+	if (p->state != DP_WRITE || p->prn_npending == 0) {
+		/* late notification of an aborted object write */
+		PROTO_LOG(LL_DEBUG, p, "Skipping stale notification");
+		return;
+	}
+
+	uint32_t offset = le32toh(resp->write.offset);
+	uint32_t crc = le32toh(resp->write.crc);
+	if (offset != p->prn_pending[0].offset || crc != p->prn_pending[0].crc) {
+		PROTO_LOG(LL_WARN, p,
+				  "PRN mismatch at offset %u: 0x%X (expected offset %u 0x%X)",
+				  offset, crc, p->prn_pending[0].offset,
+				  p->prn_pending[0].crc);
+		metrics_count(MC_PRN_ERRORS, 1);
+		proto_retry(p, "PRN mismatch");
+		return;
+	}
+
+	PROTO_LOG(LL_DEBUG, p, "PRN offset %u CRC 0x%X OK", offset, crc);
+	p->prn_npending--;
+	memmove(p->prn_pending, p->prn_pending + 1,
+			p->prn_npending * sizeof(*p->prn_pending));
+	proto_written(p);
+}
+
+static void proto_error(struct dfu_proto* p, const nrf_dfu_response_t* resp)
+{
+	if (p->state == DP_FW_VERSION) {
+		if (resp->result == NRF_DFU_RES_CODE_OP_CODE_NOT_SUPPORTED) {
+			/* bootloaders before SDK 15 */
+			PROTO_LOG(LL_INFO, p, "Firmware versions not supported");
+			p->fw_unsupported = true;
+		}
+		/* no image of this number */
+		proto_image(p);
+		return;
+	}
+
+	if (resp->result != NRF_DFU_RES_CODE_EXT_ERROR) {
+		dfu_proto_fail(p, DFU_RET_ERROR, "ERROR: %s",
+					   dfu_err_str(resp->result));
+	} else if (p->state == DP_EXECUTE
+			   && resp->ext_err == NRF_DFU_EXT_ERROR_FW_VERSION_FAILURE) {
+		dfu_proto_fail(p, DFU_RET_FW_VERSION, "ERROR: %s",
+					   dfu_ext_err_str(resp->ext_err));
+	} else {
+		dfu_proto_fail(p, DFU_RET_ERROR, "ERROR: %s",
+					   dfu_ext_err_str(resp->ext_err));
+	}
+}
+
+static void proto_crc(struct dfu_proto* p, const nrf_dfu_response_t* resp)
+{
+	uint32_t crc = le32toh(resp->crc.crc);
+	uint32_t offset = le32toh(resp->crc.offset);
+
+	PROTO_LOG(LL_INFO, p, "CRC 0x%X (offset %u)", crc, offset);
+	if (crc == p->crc && offset == p->offset) {
+		proto_execute(p);
+		return;
+	}
+
+	char why[80];
+	snprintf(why, sizeof(why), "CRC failed 0x%X vs 0x%X (offset %u vs %u)",
+			 crc, p->crc, offset, p->offset);
+	metrics_count(MC_CRC_ERRORS, 1);
+	proto_retry(p, why);
+}
+
+static void proto_executed(struct dfu_proto* p)
+{
+	PROTO_LOG(LL_INFO, p, "Object executed");
+	p->tries = 0;
+	if (p->dots && conf.loglevel < LL_INFO) {
+		LOG_NOTI_(".");
+	}
+
+	if (p->offset < p->size) {
+		proto_create(p);
+		return;
+	}
+
+	progress_update(p->progress, p->obj_start / p->max_size, p->offset,
+					p->offset, true);
+	if (p->type == 1) {
+		proto_select(p, 2);
+		return;
+	}
+
+	if (p->dots) {
+		LOG_NL(LL_NOTICE);
+		LOG_NOTI("Done");
+	}
+	proto_done(p, DFU_RET_SUCCESS);
+}
+
+void dfu_proto_response(struct dfu_proto* p, const uint8_t* buf, size_t len)
+{
+	if (dfu_proto_finished(p)) {
+		return;
+	}
+
+	if (len < 3 || buf[0] != NRF_DFU_OP_RESPONSE) {
+		PROTO_LOG(LL_INFO, p, "Ignoring unexpected frame");
+		return;
+	}
+
+	const nrf_dfu_response_t* resp = (const nrf_dfu_response_t*)(buf + 1);
+	if (resp->result == NRF_DFU_RES_CODE_SUCCESS
+		&& (resp->request == NRF_DFU_OP_OBJECT_WRITE
+			|| (resp->request == NRF_DFU_OP_CRC_GET
+				&& p->state == DP_WRITE))) {
+		/* notifications are not answers to a request. The BLE bootloader
+		 * sends them as CRC responses, no CRC is asked for while writing */
+		proto_prn(p, resp);
+		return;
+	}
+	if (resp->request != p->req || p->state == DP_WRITE) {
+		PROTO_LOG(LL_INFO, p, "Ignoring response to 0x%x", resp->request);
+		return;
+	}
+	metrics_latency(p->req, time_us() - p->req_time);
+
+	if (resp->result != NRF_DFU_RES_CODE_SUCCESS) {
+		proto_error(p, resp);
+		return;
+	}
+
+	switch (p->state) {
+	case DP_PRN:
+		p->num_fw = 0;
+		if (conf.force || p->fw_unsupported) {
+			proto_image(p);
+		} else {
+			proto_fw_version(p);
+		}
+		break;
+	case DP_FW_VERSION:
+		p->fw[p->num_fw] = resp->firmware;
+		PROTO_LOG(LL_INFO, p, "Firmware %d: type %d version %u len %u",
+				  p->num_fw, p->fw[p->num_fw].type,
+				  le32toh(p->fw[p->num_fw].version),
+				  le32toh(p->fw[p->num_fw].len));
+		if (++p->num_fw < DFU_MAX_FW) {
+			proto_fw_version(p);
+		} else {
+			proto_image(p);
+		}
+		break;
+	case DP_SELECT:
+		p->max_size = le32toh(resp->select.max_size);
+		PROTO_LOG(LL_INFO, p,
+				  "Select object %d: offset %u max_size %u CRC 0x%X", p->type,
+				  le32toh(resp->select.offset), p->max_size,
+				  le32toh(resp->select.crc));
+		if (p->max_size == 0) {
+			dfu_proto_fail(p, DFU_RET_ERROR, "Invalid max object size");
+			break;
+		}
+		proto_resume(p, le32toh(resp->select.offset),
+					 le32toh(resp->select.crc));
+		break;
+	case DP_CREATE:
+		proto_write(p, true);
+		break;
+	case DP_CRC:
+		proto_crc(p, resp);
+		break;
+	case DP_EXECUTE:
+		proto_executed(p);
+		break;
+	default:
+		break;
+	}
+}
+
+void dfu_proto_timeout(struct dfu_proto* p)
+{
+	if (dfu_proto_finished(p)) {
+		return;
+	}
+
+	metrics_count(MC_TIMEOUTS, 1);
+	if (p->state == DP_WRITE || p->state == DP_CRC) {
+		/* lost data or notification, the object can be sent again */
+		proto_retry(p, p->state == DP_WRITE ? "Timeout waiting for PRN"
+											: "Timeout waiting for CRC");
+		return;
+	}
+	dfu_proto_fail(p, DFU_RET_ERROR, "Timeout waiting for response to 0x%x",
+				   p->req);
+}
+
+void dfu_proto_init(struct dfu_proto* p, const struct dfu_proto_ops* ops,
+					void* ctx, const char* port, struct progress* progress)
+{
+	memset(p, 0, sizeof(*p));
+	p->ops = ops;
+	p->ctx = ctx;
+	p->port = port;
+	p->progress = progress;
+	p->state = DP_DONE;
+}
+
+void dfu_proto_start(struct dfu_proto* p, const struct dfu_image* img)
+{
+	p->img = img;
+	p->ret = DFU_RET_SUCCESS;
+	p->error[0] = '\0';
+
+	if (p->mtu <= p->data_header) {
+		dfu_proto_fail(p, DFU_RET_ERROR, "MTU %u too small", p->mtu);
+		return;
+	}
+
+	PROTO_LOG(LL_INFO, p, "Set packet receive notification %d", conf.prn);
+	nrf_dfu_request_t req = {
+		.request = NRF_DFU_OP_RECEIPT_NOTIF_SET,
+		.prn.target = htole16(conf.prn),
+	};
+	proto_request(p, &req, DP_PRN);
+}
@@ -0,0 +1,128 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DFU_PROTO_H
+#define DFU_PROTO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dfu.h"
+#include "nrf_dfu_req_handler.h"
+
+/* Response timeouts in milliseconds, counted from when the request has been
+ * sent out completely */
+#define RESP_TIMEOUT_DEFAULT	100
+#define RESP_TIMEOUT_OBJ_CREATE 1000
+#define RESP_TIMEOUT_OBJ_EXE	10000
+
+/* how often an object is sent again after a CRC mismatch */
+#define OBJECT_TRIES 3
+
+/* packet receipt notifications which may be outstanding while sending on */
+#define PRN_MAX_PENDING 2
+
+enum dfu_proto_state {
+	DP_PRN,
+	DP_FW_VERSION,
+	DP_SELECT,
+	DP_CREATE,
+	DP_WRITE, /* sending object data, only notifications are expected */
+	DP_CRC,
+	DP_EXECUTE,
+	DP_DONE,
+	DP_FAILED,
+};
+
+/* how the requests and object data packets go out. Both may queue */
+struct dfu_proto_ops {
+	bool (*write_ctrl)(void* ctx, const uint8_t* req, size_t len);
+	/* object data without the write opcode, like dfu_transport */
+	bool (*write_data)(void* ctx, const uint8_t* data, size_t len);
+};
+
+struct prn_expect {
+	uint32_t offset;
+	uint32_t crc;
+};
+
+/* The update procedure of one image, shared by dfu_upgrade() and the fleet
+ * state machine: PRN, firmware versions, then init packet and firmware as
+ * objects which are resumed, sent, checked and executed. It never waits
+ * itself, the caller feeds it the received frames with dfu_proto_response(),
+ * tells it about timeouts and lets it send object data while
+ * dfu_proto_can_write() is true. The result is in state and ret. */
+struct dfu_proto {
+	/* set by the caller */
+	const struct dfu_proto_ops* ops;
+	void* ctx;
+	const char* port; /* log prefix, NULL for none */
+	struct progress* progress;
+	uint16_t mtu;
+	size_t data_header;
+	int max_pending; /* notification windows to send ahead */
+	bool dots;		 /* one dot per object at LL_NOTICE */
+
+	enum dfu_proto_state state;
+	enum dfu_ret ret;
+	char error[200];
+	nrf_dfu_op_t req; /* request which waits for a response */
+	uint64_t req_time; /* us, for metrics */
+	const struct dfu_image* img;
+	/* images on the device */
+	bool fw_unsupported;
+	nrf_dfu_response_firmware_t fw[DFU_MAX_FW];
+	int num_fw;
+	/* object type which is being sent */
+	uint8_t type;
+	const uint8_t* data;
+	const uint32_t* crcs;
+	size_t size;
+	uint32_t max_size;
+	uint32_t offset;
+	uint32_t crc;
+	uint32_t obj_start;
+	uint32_t obj_start_crc;
+	uint32_t obj_end;
+	uint64_t obj_time;
+	int tries;
+	/* notifications of the current object */
+	bool prn_sync;
+	unsigned int pkts;
+	struct prn_expect prn_pending[PRN_MAX_PENDING + 1];
+	int prn_npending;
+};
+
+void dfu_proto_init(struct dfu_proto* p, const struct dfu_proto_ops* ops,
+					void* ctx, const char* port, struct progress* progress);
+void dfu_proto_start(struct dfu_proto* p, const struct dfu_image* img);
+void dfu_proto_response(struct dfu_proto* p, const uint8_t* buf, size_t len);
+/* no response within dfu_proto_timeout_ms() */
+void dfu_proto_timeout(struct dfu_proto* p);
+int dfu_proto_timeout_ms(const struct dfu_proto* p);
+bool dfu_proto_can_write(const struct dfu_proto* p);
+/* send up to max_pkts object data packets */
+void dfu_proto_fill(struct dfu_proto* p, int max_pkts);
+void dfu_proto_fail(struct dfu_proto* p, enum dfu_ret ret, const char* fmt,
+					...) __attribute__((format(printf, 3, 4)));
+bool dfu_proto_finished(const struct dfu_proto* p);
+
+#endif
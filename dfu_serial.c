@@ -18,74 +18,256 @@
  */
 
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/select.h>
+#include <termios.h>
 #include <unistd.h>
 
 #include "conf.h"
 #include "dfu.h"
 #include "dfu_serial.h"
+#include "dfu_transport.h"
 #include "log.h"
+#include "metrics.h"
 #include "serialtty.h"
 #include "slip.h"
 #include "util.h"
 
-#define DFU_SERIAL_BAUDRATE 115200
-#define MAX_READ_TRIES		SLIP_BUF_SIZE
+#define MAX_READ_BYTES SLIP_BUF_SIZE
+#define RX_BUF_SIZE	   SLIP_BUF_SIZE
+#define TX_MAX_IOV	   512
+
+/* receive state of the port, kept across frames: bytes which were read from
+ * the kernel but not yet decoded stay in buf for the next frame */
+struct ser_rx {
+	uint8_t buf[RX_BUF_SIZE];
+	size_t pos;
+	size_t len;
+	uint8_t frame[BUF_SIZE];
+	slip_t slip;
+	/* statistics */
+	unsigned int syscalls;
+	unsigned int frames;
+};
+
+/* object data frames waiting to be written with one writev(). They point
+ * into the caller's data, see ser_queue_data() */
+struct ser_tx {
+	struct iovec iov[TX_MAX_IOV];
+	int niov;
+	/* statistics */
+	unsigned int syscalls;
+	unsigned int frames;
+};
 
 static uint8_t buf[SLIP_BUF_SIZE];
+static struct ser_rx rx;
+static struct ser_tx tx;
 static int ser_fd = -1;
-static bool terminate;
+static struct termios ser_otty;
+static volatile sig_atomic_t terminate;
+/* when all written so far is sent at conf.dfuspeed. Ptys and USB CDC ACM
+ * don't report their queue in TIOCOUTQ, so it is estimated from here too */
+static uint64_t tx_done;
+
+static void ser_rx_reset(void)
+{
+	rx.pos = 0;
+	rx.len = 0;
+	rx.slip.p_buffer = rx.frame;
+	rx.slip.current_index = 0;
+	rx.slip.buffer_len = sizeof(rx.frame);
+	rx.slip.state = SLIP_STATE_DECODING;
+}
+
+/* time to send len more bytes after what is still queued in the driver */
+static int ser_tx_time(size_t len)
+{
+	uint64_t now = time_ms();
+	int queued = tx_done > now ? tx_done - now : 0;
+	return MAX(serial_tx_time(serial_out_pending(ser_fd) + len, conf.dfuspeed),
+			   queued + serial_tx_time(len, conf.dfuspeed));
+}
+
+static void ser_tx_sent(size_t len)
+{
+	tx_done = MAX(tx_done, time_ms()) + serial_tx_time(len, conf.dfuspeed);
+}
+
+/* write the first len bytes of buf */
+static bool ser_write_buf(size_t len, int timeout_ms)
+{
+	bool b = serial_write(ser_fd, (const char*)buf, len,
+						  timeout_ms + ser_tx_time(len));
+	if (b) {
+		ser_tx_sent(len);
+	}
+	return b;
+}
 
-bool ser_encode_write(uint8_t* req, size_t len, int timeout_sec)
+bool ser_encode_write(uint8_t* req, size_t len, int timeout_ms)
 {
 	uint32_t slip_len;
 	slip_encode(buf, (uint8_t*)req, len, &slip_len);
 
-	bool b = serial_write(ser_fd, (const char*)buf, slip_len, timeout_sec);
+	bool b = ser_write_buf(slip_len, timeout_ms);
 
-	if (b && conf.loglevel >= LL_DEBUG) {
+	if (b && LOG_ENABLED(LL_DEBUG)) {
 		dump_data("TX: ", req, len);
 	}
 
 	return b;
 }
 
-const uint8_t* ser_read_decode(int timeout_sec)
+/* queue an object write frame which is SLIP encoded straight from data.
+ * data has to stay valid until ser_flush() */
+bool ser_queue_data(const uint8_t* data, size_t len, int timeout_ms)
+{
+	static const uint8_t op = NRF_DFU_OP_OBJECT_WRITE;
+	int n;
+
+	for (int try = 0; try < 2; try++) {
+		/* the opcode doesn't need escaping */
+		n = slip_encode_iov(tx.iov + tx.niov + 1, TX_MAX_IOV - tx.niov - 1,
+							data, len, true);
+		if (n >= 0) {
+			break;
+		}
+		/* no space left, write what is queued */
+		if (!ser_flush(timeout_ms)) {
+			return false;
+		}
+	}
+
+	if (n >= 0) {
+		tx.iov[tx.niov].iov_base = (void*)&op;
+		tx.iov[tx.niov].iov_len = 1;
+		tx.niov += n + 1;
+	} else {
+		/* too many bytes to escape for the iovecs, encode a copy */
+		uint32_t slip_len;
+		if (2 * len + 2 > sizeof(buf)) {
+			LOG_ERR("TX frame too long");
+			return false;
+		}
+		buf[0] = op;
+		slip_encode(buf + 1, (uint8_t*)data, len, &slip_len);
+		if (!ser_write_buf(slip_len + 1, timeout_ms)) {
+			return false;
+		}
+	}
+	tx.frames++;
+
+	if (LOG_ENABLED(LL_DEBUG)) {
+		dump_data("TX: 8 ", data, len);
+	}
+
+	return true;
+}
+
+/* write all queued frames */
+bool ser_flush(int timeout_ms)
+{
+	size_t len = 0;
+
+	if (tx.niov == 0) {
+		return true;
+	}
+
+	for (int i = 0; i < tx.niov; i++) {
+		len += tx.iov[i].iov_len;
+	}
+
+	tx.syscalls++;
+	bool b = serial_writev(ser_fd, tx.iov, tx.niov,
+						   timeout_ms + ser_tx_time(len));
+	if (b) {
+		ser_tx_sent(len);
+	}
+	tx.niov = 0;
+	return b;
+}
+
+/* read and decode one frame. timeout_ms is the total time the device has to
+ * answer after everything written before has actually been sent out */
+const uint8_t* ser_read_decode(int timeout_ms, size_t* len)
 {
 	ssize_t ret;
 	int end = 0;
-	char read_buf;
-	int read_tries = 0;
+	size_t decoded = 0;
 	bool timeout;
-
-	slip_t slip = {.p_buffer = buf,
-				   .current_index = 0,
-				   .buffer_len = BUF_SIZE,
-				   .state = SLIP_STATE_DECODING};
+	uint64_t now = time_ms();
+	uint64_t deadline = now + timeout_ms + ser_tx_time(0);
 
 	do {
-		read_tries++;
-		timeout = serial_wait_read_ready(ser_fd, timeout_sec);
+		/* decode what is left from the last read first */
+		if (rx.pos < rx.len) {
+			size_t n = slip_decode_buffer(&rx.slip, rx.buf + rx.pos,
+										  rx.len - rx.pos, &end);
+			rx.pos += n;
+			decoded += n;
+			if (end == -1) {
+				LOG_ERR("RX frame too long");
+				metrics_count(MC_SLIP_ERRORS, 1);
+				ser_rx_reset();
+				return NULL;
+			} else if (end == -2) {
+				/* invalid escape, the frame is dropped */
+				metrics_count(MC_SLIP_ERRORS, 1);
+			}
+		}
+		if (end == 1 || decoded >= MAX_READ_BYTES) {
+			break;
+		}
+
+		/* data which keeps coming doesn't extend the deadline */
+		rx.syscalls++;
+		now = time_ms();
+		timeout = now >= deadline
+				  || serial_wait_read_ready(ser_fd, deadline - now);
 		if (timeout) {
 			LOG_INF("Timeout on Serial RX");
+			/* drop partial frame, like a new read would */
+			rx.slip.current_index = 0;
+			rx.slip.state = SLIP_STATE_DECODING;
 			break;
 		}
-		ret = read(ser_fd, &read_buf, 1);
-		if (ret < 0 && errno != EAGAIN) {
+		rx.syscalls++;
+		ret = read(ser_fd, rx.buf, sizeof(rx.buf));
+		if (ret == 0) {
+			/* readable but no data: the port hung up (POLLHUP) */
+			LOG_ERR("Read error: port hung up");
+			break;
+		} else if (ret < 0 && errno != EAGAIN && errno != EINTR) {
 			LOG_ERR("Read error: %d %s", errno, strerror(errno));
 			break;
 		} else if (ret > 0) {
-			end = slip_decode_add_byte(&slip, read_buf);
+			rx.pos = 0;
+			rx.len = ret;
 		}
-	} while (end != 1 && read_tries < MAX_READ_TRIES && !terminate);
+	} while (!terminate);
+
+	if (end != 1) {
+		return NULL;
+	}
 
-	if (conf.loglevel >= LL_DEBUG) {
-		dump_data("RX: ", slip.p_buffer, slip.current_index);
+	rx.frames++;
+	if (LOG_ENABLED(LL_DEBUG)) {
+		dump_data("RX: ", rx.slip.p_buffer, rx.slip.current_index);
 	}
 
-	return (end == 1 ? buf : NULL);
+	/* the frame stays valid until the next call */
+	*len = rx.slip.current_index;
+	rx.slip.current_index = 0;
+	return rx.frame;
+}
+
+/* true if received data is waiting to be decoded */
+bool ser_read_pending(void)
+{
+	return rx.pos < rx.len || !serial_wait_read_ready(ser_fd, 0);
 }
 
 static bool ser_enter_dfu_cmd(void)
@@ -96,31 +278,42 @@ static bool ser_enter_dfu_cmd(void)
 
 	/* first read and discard anything that came before */
 	read(ser_fd, b, 200);
+	ser_rx_reset();
 
 	LOG_INF("Sending command to enter DFU mode: '%s'", conf.dfucmd);
 	if (conf.dfucmd_hex) {
 		hex_to_bin(conf.dfucmd, (uint8_t*)b, strlen(conf.dfucmd));
 		size_t len = strlen(conf.dfucmd) / 2;
-		serial_write(ser_fd, b, len, 1);
+		serial_write(ser_fd, b, len, 1000);
 	} else {
 		/* it looks like the first two characters written are lost...
 		 * and we need \r to enter CLI */
-		serial_write(ser_fd, "\r\r\r", 3, 1);
-		serial_write(ser_fd, conf.dfucmd, strlen(conf.dfucmd), 1);
-		serial_write(ser_fd, "\r", 1, 1);
+		serial_write(ser_fd, "\r\r\r", 3, 1000);
+		serial_write(ser_fd, conf.dfucmd, strlen(conf.dfucmd), 1000);
+		serial_write(ser_fd, "\r", 1, 1000);
 	}
 
 	if (conf.ser_acm) {
 		/* device sends reply but it's easy to miss, since the serial port
 		 * disappears inmediately afterwards, so we ignore it and just reopen
 		 * the port */
-		ser_reopen(2);
+		ser_reopen(DFU_CMD_REOPEN_TIMEOUT);
 		return true;
 	}
 
-	sleep(1);
+	/* wait for the reply, it is complete when the device has been quiet for
+	 * a moment */
+	int ret = 0;
+	int wait = DFU_CMD_REPLY_WAIT;
+	while (ret < (int)sizeof(b) - 1 && !serial_wait_read_ready(ser_fd, wait)) {
+		int n = read(ser_fd, b + ret, sizeof(b) - 1 - ret);
+		if (n <= 0) {
+			break;
+		}
+		ret += n;
+		wait = DFU_CMD_REPLY_QUIET;
+	}
 
-	int ret = read(ser_fd, b, 200);
 	if (ret > 0) {
 		if (!conf.dfucmd_hex) {
 			/* debug output reply */
@@ -140,77 +333,189 @@ static bool ser_enter_dfu_cmd(void)
 			LOG_INF("Device replied with %d bytes", ret);
 		}
 
-		serial_set_baudrate(ser_fd, DFU_SERIAL_BAUDRATE);
+		serial_set_baudrate(ser_fd, conf.dfuspeed);
+		ser_rx_reset();
 		return true;
 	} else {
 		LOG_INF("Device didn't repy (%d)", ret);
-		serial_set_baudrate(ser_fd, DFU_SERIAL_BAUDRATE);
+		serial_set_baudrate(ser_fd, conf.dfuspeed);
 		return false;
 	}
 }
 
-bool ser_enter_dfu(void)
+/* true if the device sent something within ms */
+static bool ser_wait_data(int ms)
 {
-	ser_fd = serial_init(conf.serport, DFU_SERIAL_BAUDRATE);
-	if (ser_fd <= 0) {
-		return false;
-	}
+	return rx.pos < rx.len || !serial_wait_read_ready(ser_fd, ms);
+}
 
-	/* first check if Bootloader responds to Ping */
-	LOG_NOTI_("Waiting for device to be ready: ");
-	int ntry = 0;
-	bool ret = false;
-	do {
-		if (conf.dfucmd) {
-			ret = ser_enter_dfu_cmd();
-			if (terminate) {
-				ret = false;
-				break;
-			}
-			sleep(1);
-			if (!ret) {
-				/* if dfu command failed, try ping, it will
-				 * usually fail with "Opcode not supported"
-				 * because of the text we sent before, but then
-				 * the next one below can succeed */
-				ret = dfu_ping();
-			}
-		} else {
-			sleep(1);
+/* ping until the bootloader answers: right away, then with pauses growing
+ * from DFU_PING_BACKOFF_MIN to DFU_PING_BACKOFF_MAX, which end early when the
+ * device sends anything. With dfucmd the DFU command is sent first and again
+ * every DFU_CMD_RETRY */
+static bool ser_ping_bootloader(int timeout_ms, bool dfucmd)
+{
+	uint64_t start = time_ms();
+	uint64_t now = start;
+	uint64_t cmd_time = 0;
+	int backoff = DFU_PING_BACKOFF_MIN;
+	int pings = 0;
+
+	while (!terminate && now < start + timeout_ms) {
+		if (dfucmd && (cmd_time == 0 || now - cmd_time >= DFU_CMD_RETRY)) {
+			/* when the command fails the ping usually fails with "Opcode
+			 * not supported" because of the text we sent before, but then
+			 * the next one can succeed */
+			ser_enter_dfu_cmd();
+			cmd_time = time_ms();
+			backoff = DFU_PING_BACKOFF_MIN;
 		}
 
-		if (conf.loglevel < LL_INFO) {
-			printf(".");
-			fflush(stdout);
+		pings++;
+		if (dfu_ping()) {
+			LOG_NL(LL_NOTICE);
+			LOG_NOTI("Bootloader ready after %u ms (%d pings)",
+					 (unsigned)(time_ms() - start), pings);
+			return true;
 		}
 
-		if (!terminate) {
-			ret = dfu_ping();
+		if (conf.loglevel < LL_INFO) {
+			LOG_NOTI_(".");
 		}
-	} while (!ret && ++ntry < conf.timeout && !terminate);
+
+		ser_wait_data(backoff);
+		backoff = MIN(backoff * 2, DFU_PING_BACKOFF_MAX);
+		now = time_ms();
+	}
 
 	LOG_NL(LL_NOTICE);
+	if (!terminate) {
+		LOG_NOTI("Device didn't respond after %d pings in %u ms", pings,
+				 (unsigned)(now - start));
+	}
+	return false;
+}
 
-	if (ntry >= conf.timeout) {
-		LOG_NOTI("Device didn't respond after %d tries", conf.timeout);
+bool ser_enter_dfu(void)
+{
+	ser_fd = serial_init(conf.serport, conf.dfuspeed, &ser_otty);
+	if (ser_fd <= 0) {
 		return false;
 	}
-	return ret;
+	ser_rx_reset();
+
+	LOG_NOTI_("Waiting for device to be ready: ");
+	return ser_ping_bootloader(conf.timeout * 1000, conf.dfucmd != NULL);
+}
+
+/* wait for the bootloader after it has reset itself */
+bool ser_wait_bootloader(int timeout_ms)
+{
+	LOG_NOTI_("Waiting for bootloader: ");
+	return ser_ping_bootloader(timeout_ms, false);
 }
 
 void ser_fini(void)
 {
 	terminate = true;
 	if (ser_fd > 0) {
-		serial_fini(ser_fd);
+		if (rx.frames > 0) {
+			LOG_INF("Serial RX: %u frames, %u syscalls (%.1f per frame)",
+					rx.frames, rx.syscalls, (float)rx.syscalls / rx.frames);
+		}
+		if (tx.frames > 0) {
+			LOG_INF("Serial TX: %u data frames, %u writev calls", tx.frames,
+					tx.syscalls);
+		}
+		serial_fini(ser_fd, &ser_otty);
 		ser_fd = -1;
 	}
 }
 
-void ser_reopen(int sleep_time)
+/* reopen the port as soon as the device has reconnected, waiting at most
+ * timeout_ms */
+void ser_reopen(int timeout_ms)
+{
+	uint64_t start = time_ms();
+
+	LOG_NOTI("Reopen %s...", conf.serport);
+	ser_fd = serial_reopen(ser_fd, &ser_otty, conf.serport, conf.dfuspeed,
+						  timeout_ms);
+	LOG_INF("Reopened %s after %u ms", conf.serport,
+			(unsigned)(time_ms() - start));
+	ser_rx_reset();
+	tx.niov = 0;
+}
+
+/* ms, plus the time to send */
+#define SER_TIMEOUT_WRITE 100
+
+static bool ser_write_ctrl(const uint8_t* req, size_t len)
+{
+	return !terminate
+		   && ser_encode_write((uint8_t*)req, len, SER_TIMEOUT_WRITE);
+}
+
+static bool ser_write_data(const uint8_t* data, size_t len)
+{
+	return !terminate && ser_queue_data(data, len, SER_TIMEOUT_WRITE);
+}
+
+static bool ser_flush_data(void)
+{
+	return !terminate && ser_flush(SER_TIMEOUT_WRITE);
+}
+
+static void ser_stop(void)
+{
+	terminate = true;
+}
+
+static bool ser_stopped(void)
+{
+	return terminate;
+}
+
+/* right after the last EXECUTE the bootloader still answers: ping until it
+ * doesn't, so the next image isn't started on a device about to reset */
+static void ser_wait_reset(void)
+{
+	uint64_t start = time_ms();
+
+	while (!terminate && time_ms() - start < DFU_RESET_WAIT) {
+		if (!dfu_ping()) {
+			LOG_INF("Device reset after %u ms",
+					(unsigned)(time_ms() - start));
+			return;
+		}
+		ser_wait_data(DFU_PING_BACKOFF_MIN);
+	}
+	LOG_INF("No reset seen after %d ms", DFU_RESET_WAIT);
+}
+
+static bool ser_reenter(void)
 {
-	LOG_NOTI("Reopen %s in %d seconds...", conf.serport, sleep_time);
-	serial_fini(ser_fd);
-	sleep(sleep_time);
-	ser_fd = serial_init(conf.serport, DFU_SERIAL_BAUDRATE);
+	/* reopen ACM device and ping until the bootloader is back. The ACM
+	 * device only disappears when the device resets */
+	if (conf.ser_acm) {
+		ser_reopen(DFU_REOPEN_TIMEOUT);
+	} else {
+		ser_wait_reset();
+	}
+	return ser_wait_bootloader(DFU_REOPEN_TIMEOUT);
 }
+
+const struct dfu_transport dfu_serial_transport = {
+	.name = "serial",
+	.data_header = 1,
+	.enter = ser_enter_dfu,
+	.reenter = ser_reenter,
+	.write_ctrl = ser_write_ctrl,
+	.write_data = ser_write_data,
+	.flush = ser_flush_data,
+	.read = ser_read_decode,
+	.read_pending = ser_read_pending,
+	.stop = ser_stop,
+	.stopped = ser_stopped,
+	.close = ser_fini,
+};
@@ -28,10 +28,34 @@
 #define BUF_SIZE	  1050
 #define SLIP_BUF_SIZE (BUF_SIZE * 2 + 1)
 
+/* default, the bootloader baud rate is conf.dfuspeed */
+#define DFU_SERIAL_BAUDRATE 115200
+
+/* waiting for the bootloader, in milliseconds: pings are sent right away,
+ * then with pauses growing from MIN to MAX */
+#define DFU_PING_BACKOFF_MIN 10
+#define DFU_PING_BACKOFF_MAX 500
+/* the DFU command is sent again when the bootloader didn't answer */
+#define DFU_CMD_RETRY 2000
+/* the reply to the DFU command ends when the device is quiet this long */
+#define DFU_CMD_REPLY_WAIT	1000
+#define DFU_CMD_REPLY_QUIET 20
+/* the bootloader restarts after a SoftDevice/Bootloader update */
+#define DFU_REOPEN_TIMEOUT 10000
+/* until it resets it still answers pings: they are only taken after one
+ * went unanswered, or after this long like the 5 s sleep before */
+#define DFU_RESET_WAIT 5000
+/* an ACM port reconnects after the DFU command */
+#define DFU_CMD_REOPEN_TIMEOUT 2000
+
 bool ser_enter_dfu(void);
-bool ser_encode_write(uint8_t* req, size_t len, int timeout_sec);
-const uint8_t* ser_read_decode(int timeout_sec);
+bool ser_wait_bootloader(int timeout_ms);
+bool ser_encode_write(uint8_t* req, size_t len, int timeout_ms);
+bool ser_queue_data(const uint8_t* data, size_t len, int timeout_ms);
+bool ser_flush(int timeout_ms);
+const uint8_t* ser_read_decode(int timeout_ms, size_t* len);
+bool ser_read_pending(void);
 void ser_fini(void);
-void ser_reopen(int sleep_time);
+void ser_reopen(int timeout_ms);
 
 #endif
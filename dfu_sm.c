@@ -0,0 +1,565 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef __APPLE__
+#include "mac_endian.h"
+#else
+#include <endian.h>
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "conf.h"
+#include "dfu.h"
+#include "dfu_proto.h"
+#include "dfu_sm.h"
+#include "log.h"
+#include "metrics.h"
+#include "serialtty.h"
+#include "util.h"
+
+/* room for a request behind the object data in the transmit buffer */
+#define DFU_SM_TX_RESERVE 32
+
+void dfu_sm_close(struct dfu_sm* s)
+{
+	if (s->fd >= 0) {
+		serial_fini(s->fd, &s->otty);
+		s->fd = -1;
+	}
+	s->tx_pos = s->tx_len = 0;
+	s->want_write = false;
+}
+
+void dfu_sm_fail(struct dfu_sm* s, const char* fmt, ...)
+{
+	char msg[200];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+
+	LOG_ERR("%s: %s", s->port, msg);
+	progress_result(&s->progress, false, msg);
+	dfu_sm_close(s);
+	s->state = DS_FAILED;
+	s->deadline = 0;
+}
+
+bool dfu_sm_finished(const struct dfu_sm* s)
+{
+	return s->state == DS_DONE || s->state == DS_FAILED;
+}
+
+static bool sm_open(struct dfu_sm* s)
+{
+	s->fd = serial_init(s->port, conf.dfuspeed, &s->otty);
+	if (s->fd < 0) {
+		return false;
+	}
+
+	s->fd_gen++;
+	s->ino = serial_node_ino(s->fd);
+	s->slip.p_buffer = s->frame;
+	s->slip.current_index = 0;
+	s->slip.buffer_len = sizeof(s->frame);
+	s->slip.state = SLIP_STATE_DECODING;
+	return true;
+}
+
+/* a response timeout counts from when everything queued has actually been
+ * sent out, like in ser_read_decode() */
+static void sm_arm(struct dfu_sm* s, int timeout_ms)
+{
+	size_t len = s->tx_len - s->tx_pos + serial_out_pending(s->fd);
+	s->deadline = time_ms() + serial_tx_time(len, conf.dfuspeed) + timeout_ms;
+}
+
+/* write as much of the queued frames as the port takes without blocking.
+ * return: false if the session failed */
+static bool sm_flush(struct dfu_sm* s)
+{
+	while (s->tx_pos < s->tx_len) {
+		ssize_t ret = write(s->fd, s->tx + s->tx_pos, s->tx_len - s->tx_pos);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN) {
+				s->want_write = true;
+				return true;
+			}
+			dfu_sm_fail(s, "Write error: %d %s", errno, strerror(errno));
+			return false;
+		}
+		s->tx_pos += ret;
+		if (s->state == DS_UPDATE) {
+			/* the port still takes data, the device can't answer before */
+			sm_arm(s, dfu_proto_timeout_ms(&s->proto));
+		}
+	}
+
+	s->tx_pos = s->tx_len = 0;
+	s->want_write = false;
+	return true;
+}
+
+static void sm_queue(struct dfu_sm* s, const uint8_t* data, size_t len)
+{
+	uint32_t slip_len;
+	capture_frame(s->cap_intf, CAPTURE_TX, NULL, 0, data, len);
+	slip_encode(s->tx + s->tx_len, (uint8_t*)data, len, &slip_len);
+	s->tx_len += slip_len;
+}
+
+static bool sm_proto_write_ctrl(void* ctx, const uint8_t* req, size_t len)
+{
+	sm_queue(ctx, req, len);
+	return true;
+}
+
+/* dfu_proto only writes as many packets as sm_update() lets it */
+static bool sm_proto_write_data(void* ctx, const uint8_t* data, size_t len)
+{
+	struct dfu_sm* s = ctx;
+	uint8_t pkt[BUF_SIZE];
+
+	pkt[0] = NRF_DFU_OP_OBJECT_WRITE;
+	memcpy(pkt + 1, data, len);
+	sm_queue(s, pkt, len + 1);
+	return true;
+}
+
+static const struct dfu_proto_ops sm_proto_ops = {
+	.write_ctrl = sm_proto_write_ctrl,
+	.write_data = sm_proto_write_data,
+};
+
+static void sm_request(struct dfu_sm* s, nrf_dfu_request_t* req,
+					   enum dfu_sm_state state)
+{
+	sm_queue(s, (uint8_t*)req, dfu_request_size(req));
+	s->req = req->request;
+	s->req_time = time_us();
+	s->state = state;
+	sm_arm(s, RESP_TIMEOUT_DEFAULT);
+	sm_flush(s);
+}
+
+static void sm_ping(struct dfu_sm* s)
+{
+	nrf_dfu_request_t req = {
+		.request = NRF_DFU_OP_PING,
+		.ping.id = ++s->ping_id,
+	};
+	sm_request(s, &req, DS_PING);
+	/* the pause before the next ping is part of the timeout, so an answer
+	 * is still taken immediately */
+	s->deadline = time_ms() + RESP_TIMEOUT_DEFAULT + s->backoff;
+	s->backoff = MIN(s->backoff * 2, DFU_PING_BACKOFF_MAX);
+}
+
+static void sm_wait_bootloader(struct dfu_sm* s)
+{
+	s->wait_start = time_ms();
+	s->backoff = DFU_PING_BACKOFF_MIN;
+	s->reset_seen = true;
+}
+
+static void sm_enter(struct dfu_sm* s)
+{
+	size_t len = strlen(conf.dfucmd);
+
+	if (len + 4 > sizeof(s->tx) - s->tx_len) {
+		dfu_sm_fail(s, "DFU command too long");
+		return;
+	}
+
+	serial_set_baudrate(s->fd, conf.serspeed);
+
+	if (conf.dfucmd_hex) {
+		hex_to_bin(conf.dfucmd, s->tx + s->tx_len, len / 2);
+		s->tx_len += len / 2;
+	} else {
+		/* see ser_enter_dfu_cmd() */
+		memcpy(s->tx + s->tx_len, "\r\r\r", 3);
+		memcpy(s->tx + s->tx_len + 3, conf.dfucmd, len);
+		s->tx[s->tx_len + 3 + len] = '\r';
+		s->tx_len += len + 4;
+	}
+
+	s->state = DS_ENTER;
+	s->req = NRF_DFU_OP_INVALID;
+	s->cmd_time = time_ms();
+	s->backoff = DFU_PING_BACKOFF_MIN;
+	s->deadline = s->cmd_time
+				  + (s->acm ? DFU_CMD_REOPEN_TIMEOUT : DFU_CMD_REPLY_WAIT);
+	sm_flush(s);
+}
+
+static void sm_done(struct dfu_sm* s)
+{
+	LOG_NOTI("%s: Done (%.1f sec)", s->port,
+			 (time_ms() - s->start_time) / 1000.0);
+	progress_result(&s->progress, true, NULL);
+	dfu_sm_close(s);
+	s->state = DS_DONE;
+	s->deadline = 0;
+}
+
+static void sm_update(struct dfu_sm* s);
+
+static void sm_image(struct dfu_sm* s)
+{
+	s->state = DS_UPDATE;
+	s->req = NRF_DFU_OP_INVALID;
+	dfu_proto_start(&s->proto, &s->images[s->img]);
+	sm_update(s);
+}
+
+static void sm_next_image(struct dfu_sm* s, bool reopen)
+{
+	s->img++;
+	if (s->img >= s->num_images) {
+		if (reopen) {
+			sm_done(s);
+			return;
+		}
+		/* still in the bootloader, see dfu_abort(). The port is closed
+		 * once the request is written */
+		nrf_dfu_request_t req = {
+			.request = NRF_DFU_OP_ABORT,
+		};
+		sm_request(s, &req, DS_ABORT);
+		if (s->state == DS_ABORT && s->tx_len == 0) {
+			sm_done(s);
+		}
+		return;
+	}
+
+	LOG_NOTI("%s: Updating %s (%zd bytes)", s->port, s->images[s->img].name,
+			 s->images[s->img].bin_size);
+
+	if (!reopen) {
+		sm_image(s);
+		return;
+	}
+
+	/* the device resets after a SoftDevice/Bootloader update */
+	progress_phase(&s->progress, "enter", s->images[s->img].name, 0);
+	if (s->acm) {
+		dfu_sm_close(s);
+	}
+	s->state = DS_REOPEN;
+	s->req = NRF_DFU_OP_INVALID;
+	sm_wait_bootloader(s);
+	/* the ACM device only disappears when the device resets, on other ports
+	 * pings are answered until a ping goes unanswered */
+	s->reset_seen = s->acm;
+	s->deadline = s->acm ? s->wait_start + DFU_REOPEN_TIMEOUT : s->wait_start;
+}
+
+/* keep the port busy with object data while dfu_proto lets us, then act on
+ * the result of the image */
+static void sm_update(struct dfu_sm* s)
+{
+	struct dfu_proto* p = &s->proto;
+	const struct dfu_image* img = &s->images[s->img];
+
+	while (sm_flush(s)) {
+		if (s->tx_len > 0 || !dfu_proto_can_write(p)) {
+			break;
+		}
+		dfu_proto_fill(p, (sizeof(s->tx) - DFU_SM_TX_RESERVE)
+							  / (2 * p->mtu + 2));
+	}
+	if (s->state != DS_UPDATE) {
+		return;
+	}
+
+	if (!dfu_proto_finished(p)) {
+		sm_arm(s, dfu_proto_timeout_ms(p));
+	} else if (p->ret == DFU_RET_SUCCESS) {
+		sm_next_image(s, true);
+	} else if (p->ret == DFU_RET_CURRENT) {
+		LOG_NOTI("%s: %s is already current, skipped", s->port, img->name);
+		sm_next_image(s, false);
+	} else if (p->ret == DFU_RET_FW_VERSION
+			   && strcmp(img->name, "Application") != 0) {
+		/* same as in main(): try updating the next image */
+		LOG_NOTI("%s: %s not updated!", s->port, img->name);
+		sm_next_image(s, false);
+	} else {
+		dfu_sm_fail(s, "%s", p->error);
+	}
+}
+
+static void sm_response(struct dfu_sm* s, const uint8_t* buf, size_t len)
+{
+	if (s->state == DS_UPDATE) {
+		dfu_proto_response(&s->proto, buf, len);
+		sm_update(s);
+		return;
+	}
+
+	if (len < 3 || buf[0] != NRF_DFU_OP_RESPONSE) {
+		LOG_INF("%s: Ignoring unexpected frame", s->port);
+		return;
+	}
+
+	nrf_dfu_response_t* resp = (nrf_dfu_response_t*)(buf + 1);
+	if (resp->request != s->req) {
+		LOG_INF("%s: Ignoring response to 0x%x", s->port, resp->request);
+		return;
+	}
+	metrics_latency(s->req, time_us() - s->req_time);
+
+	if (resp->result != NRF_DFU_RES_CODE_SUCCESS) {
+		if (s->state == DS_PING) {
+			/* usually "Opcode not supported" because of the DFU command
+			 * text before, the next ping is sent when the timer expires */
+			return;
+		}
+		dfu_sm_fail(s, "ERROR: %s", dfu_err_str(resp->result));
+		return;
+	}
+
+	switch (s->state) {
+	case DS_PING:
+		if (resp->ping.id != s->ping_id) {
+			return;
+		}
+		if (!s->reset_seen) {
+			/* the bootloader before the reset, ping again soon */
+			s->state = DS_REOPEN;
+			s->backoff = DFU_PING_BACKOFF_MIN;
+			s->deadline = time_ms() + DFU_PING_BACKOFF_MIN;
+			return;
+		}
+		LOG_INF("%s: Bootloader ready after %u ms", s->port,
+				(unsigned)(time_ms() - s->wait_start));
+		if (s->proto.mtu == 0) {
+			nrf_dfu_request_t req = {
+				.request = NRF_DFU_OP_MTU_GET,
+			};
+			sm_request(s, &req, DS_MTU);
+		} else {
+			/* bootloader came back after reset */
+			sm_image(s);
+		}
+		break;
+	case DS_MTU:
+		s->proto.mtu = dfu_slip_mtu(le16toh(resp->mtu.size));
+		if (s->proto.mtu == 0) {
+			dfu_sm_fail(s, "MTU %d too small", le16toh(resp->mtu.size));
+			break;
+		}
+		LOG_INF("%s: MTU %d", s->port, s->proto.mtu);
+		sm_image(s);
+		break;
+	default:
+		break;
+	}
+}
+
+void dfu_sm_readable(struct dfu_sm* s)
+{
+	uint8_t buf[SLIP_BUF_SIZE];
+
+	if (s->fd < 0) {
+		return;
+	}
+
+	ssize_t len = read(s->fd, buf, sizeof(buf));
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			dfu_sm_fail(s, "Read error: %d %s", errno, strerror(errno));
+		}
+		return;
+	}
+
+	/* text reply to the DFU command or output of the rebooting device */
+	if (s->state == DS_ENTER || s->state == DS_REOPEN) {
+		/* the reply ends when the device is quiet for a moment */
+		if (s->state == DS_ENTER && !s->acm) {
+			s->deadline = MIN(time_ms() + DFU_CMD_REPLY_QUIET,
+							  s->cmd_time + DFU_CMD_REPLY_WAIT);
+		}
+		return;
+	}
+
+	for (ssize_t i = 0; i < len && s->fd >= 0;) {
+		int ret;
+		i += slip_decode_buffer(&s->slip, buf + i, len - i, &ret);
+		if (ret == 1) {
+			size_t flen = s->slip.current_index;
+			s->slip.current_index = 0;
+			if (flen > 0) {
+				capture_frame(s->cap_intf, CAPTURE_RX, NULL, 0, s->frame, flen);
+				sm_response(s, s->frame, flen);
+			}
+		} else if (ret == -1) {
+			metrics_count(MC_SLIP_ERRORS, 1);
+			s->slip.current_index = 0;
+			s->slip.state = SLIP_STATE_DECODING;
+		} else if (ret == -2) {
+			metrics_count(MC_SLIP_ERRORS, 1);
+		}
+	}
+}
+
+void dfu_sm_writable(struct dfu_sm* s)
+{
+	if (s->fd < 0) {
+		return;
+	}
+
+	if (s->state == DS_UPDATE) {
+		sm_update(s);
+	} else if (sm_flush(s) && s->state == DS_ABORT && s->tx_len == 0) {
+		sm_done(s);
+	}
+}
+
+/* a device node was created or changed: when the port of a resetting device
+ * is back, let the timer open it now */
+void dfu_sm_node_changed(struct dfu_sm* s)
+{
+	if (s->fd < 0 && (s->state == DS_ENTER || s->state == DS_REOPEN)
+		&& serial_node_changed(s->port, s->ino)) {
+		s->deadline = time_ms();
+	}
+}
+
+void dfu_sm_hangup(struct dfu_sm* s)
+{
+	if (s->state == DS_ENTER || s->state == DS_REOPEN) {
+		/* ACM device disappears when the device resets, the timer
+		 * opens it again after dfu_sm_node_changed() or the timeout */
+		dfu_sm_close(s);
+		dfu_sm_node_changed(s);
+		return;
+	}
+	dfu_sm_fail(s, "Port disconnected");
+}
+
+void dfu_sm_timer(struct dfu_sm* s)
+{
+	s->deadline = 0;
+
+	switch (s->state) {
+	case DS_ENTER:
+		if (s->acm) {
+			dfu_sm_close(s);
+		}
+		if (s->fd < 0 && !sm_open(s)) {
+			dfu_sm_fail(s, "Could not reopen");
+			return;
+		}
+		serial_set_baudrate(s->fd, conf.dfuspeed);
+		sm_ping(s);
+		break;
+	case DS_REOPEN:
+		if (s->fd < 0 && !sm_open(s)) {
+			dfu_sm_fail(s, "Could not reopen");
+			return;
+		}
+		if (!s->reset_seen && time_ms() - s->wait_start >= DFU_RESET_WAIT) {
+			LOG_INF("%s: No reset seen after %d ms", s->port, DFU_RESET_WAIT);
+			s->reset_seen = true;
+		}
+		sm_ping(s);
+		break;
+	case DS_PING:
+		if (!s->reset_seen) {
+			LOG_INF("%s: Device reset after %u ms", s->port,
+					(unsigned)(time_ms() - s->wait_start));
+			s->reset_seen = true;
+		}
+		if (time_ms() - s->wait_start >= (uint64_t)conf.timeout * 1000) {
+			dfu_sm_fail(s, "Device didn't respond after %d seconds",
+						conf.timeout);
+		} else if (conf.dfucmd && s->proto.mtu == 0
+				   && time_ms() - s->cmd_time >= DFU_CMD_RETRY) {
+			sm_enter(s);
+		} else {
+			sm_ping(s);
+		}
+		break;
+	case DS_UPDATE:
+		dfu_proto_timeout(&s->proto);
+		sm_update(s);
+		break;
+	case DS_ABORT:
+		/* the bootloader starts the application on its own after a while */
+		LOG_INF("%s: ABORT not written", s->port);
+		sm_done(s);
+		break;
+	case DS_DONE:
+	case DS_FAILED:
+		break;
+	default:
+		metrics_count(MC_TIMEOUTS, 1);
+		dfu_sm_fail(s, "Timeout (state %d request 0x%x)", s->state, s->req);
+		break;
+	}
+}
+
+void dfu_sm_init(struct dfu_sm* s, const char* port,
+				 const struct dfu_image* images, int num_images)
+{
+	memset(s, 0, sizeof(*s));
+	s->port = port;
+	s->progress.port = port;
+	s->cap_intf = capture_add_port(port);
+	s->acm = strstr(port, "ACM") != NULL;
+	s->fd = -1;
+	s->images = images;
+	s->num_images = num_images;
+	dfu_proto_init(&s->proto, &sm_proto_ops, s, port, &s->progress);
+	s->proto.data_header = 1;
+	s->proto.max_pending = PRN_MAX_PENDING;
+}
+
+void dfu_sm_start(struct dfu_sm* s)
+{
+	s->start_time = time_ms();
+
+	LOG_NOTI("%s: Updating %s (%zd bytes)", s->port, s->images[0].name,
+			 s->images[0].bin_size);
+	progress_phase(&s->progress, "enter", s->images[0].name, 0);
+
+	if (!sm_open(s)) {
+		dfu_sm_fail(s, "Could not open");
+		return;
+	}
+
+	sm_wait_bootloader(s);
+	if (conf.dfucmd) {
+		sm_enter(s);
+	} else {
+		sm_ping(s);
+	}
+}
@@ -0,0 +1,109 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DFU_SM_H
+#define DFU_SM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <termios.h>
+
+#include "dfu.h"
+#include "dfu_proto.h"
+#include "dfu_serial.h"
+#include "nrf_dfu_req_handler.h"
+#include "progress.h"
+#include "slip.h"
+
+#define DFU_SM_TX_BUF_SIZE (4 * SLIP_BUF_SIZE)
+
+enum dfu_sm_state {
+	DS_ENTER, /* DFU command sent, waiting for the device to reset */
+	DS_PING,
+	DS_MTU,
+	DS_UPDATE, /* dfu_proto sends the current image */
+	DS_REOPEN, /* waiting for the bootloader to come back between images */
+	DS_ABORT,  /* waiting until the ABORT request is written */
+	DS_DONE,
+	DS_FAILED,
+};
+
+/* Non-blocking update of one device over a serial port. The images are sent
+ * by the same procedure as in dfu_upgrade(), in dfu_proto.c, the state
+ * machine adds opening the port, the DFU command, waiting for the bootloader
+ * and the sequence of images. It never waits itself: the event loop calls
+ * dfu_sm_readable(), dfu_sm_writable() and dfu_sm_hangup() for the events of
+ * fd and dfu_sm_timer() when deadline has passed.
+ *
+ * The state machine opens and closes the port itself. The event loop has to
+ * watch fd again whenever fd_gen changes, and for writability while
+ * want_write is set. All memory is in this struct. */
+struct dfu_sm {
+	/* read by the event loop */
+	int fd; /* -1 while the port is closed */
+	unsigned int fd_gen;
+	bool want_write;
+	uint64_t deadline; /* ms (time_ms()), 0 when no timer is running */
+	enum dfu_sm_state state;
+
+	const char* port;
+	bool acm;
+	ino_t ino; /* device node, to notice when it is recreated */
+	struct termios otty; /* attributes before, restored on close */
+	const struct dfu_image* images;
+	int num_images;
+	int img;
+	nrf_dfu_op_t req; /* request of the port which waits for a response */
+	uint64_t req_time; /* us, for metrics */
+	struct progress progress;
+	int cap_intf;
+	uint64_t start_time;
+	/* waiting for the bootloader, see ser_ping_bootloader() */
+	uint64_t wait_start;
+	uint64_t cmd_time;
+	int backoff;
+	uint8_t ping_id;
+	bool reset_seen; /* answers are taken, see DFU_RESET_WAIT */
+	struct dfu_proto proto; /* proto.mtu is 0 until asked for */
+	/* SLIP encoded frames waiting to be written */
+	uint8_t tx[DFU_SM_TX_BUF_SIZE];
+	size_t tx_pos;
+	size_t tx_len;
+	/* receive state */
+	slip_t slip;
+	uint8_t frame[BUF_SIZE];
+};
+
+void dfu_sm_init(struct dfu_sm* s, const char* port,
+				 const struct dfu_image* images, int num_images);
+void dfu_sm_start(struct dfu_sm* s);
+void dfu_sm_readable(struct dfu_sm* s);
+void dfu_sm_writable(struct dfu_sm* s);
+void dfu_sm_hangup(struct dfu_sm* s);
+void dfu_sm_timer(struct dfu_sm* s);
+void dfu_sm_node_changed(struct dfu_sm* s);
+void dfu_sm_fail(struct dfu_sm* s, const char* fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void dfu_sm_close(struct dfu_sm* s);
+bool dfu_sm_finished(const struct dfu_sm* s);
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DFU_TRANSPORT_H
+#define DFU_TRANSPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* how the DFU protocol in dfu.c talks to the bootloader */
+struct dfu_transport {
+	const char* name;
+	/* fixed MTU, or 0 to ask the bootloader */
+	uint16_t mtu;
+	/* bytes of the MTU used by the write opcode in front of object data */
+	size_t data_header;
+	/* get the device into the bootloader and connect to it */
+	bool (*enter)(void);
+	/* connect again after the bootloader has reset itself */
+	bool (*reenter)(void);
+	bool (*write_ctrl)(const uint8_t* req, size_t len);
+	/* object data packet, may be queued until flush() */
+	bool (*write_data)(const uint8_t* data, size_t len);
+	/* optional: write all queued data packets */
+	bool (*flush)(void);
+	/* response or notification of len bytes, or NULL after timeout_ms */
+	const uint8_t* (*read)(int timeout_ms, size_t* len);
+	/* optional: true if read() would not wait. Without it packet receipt
+	 * notifications are waited for at every window */
+	bool (*read_pending)(void);
+	/* make the update fail at the next read or write. Called from the
+	 * SIGINT handler, so it only sets a flag */
+	void (*stop)(void);
+	/* true after stop(): reads then fail at once, which is no timeout */
+	bool (*stopped)(void);
+	void (*close)(void);
+};
+
+extern const struct dfu_transport dfu_serial_transport;
+extern const struct dfu_transport dfu_ble_transport;
+
+#endif
@@ -0,0 +1,802 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/* nrfdfu-emu: the bootloader side of Nordic serial DFU on a pseudo terminal,
+ * so the transport and protocol can be measured without hardware */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include "mac_endian.h"
+#else
+#include <endian.h>
+#endif
+
+#include <zlib.h>
+
+#include "conf.h"
+#include "dfu_serial.h"
+#include "initpkt.h"
+#include "log.h"
+#include "nrf_dfu_req_handler.h"
+#include "slip.h"
+#include "util.h"
+
+/* maximum size of the init command object */
+#define EMU_COMMAND_MAX_SIZE 512
+
+struct config conf;
+
+static struct {
+	const char* link;
+	uint16_t mtu;
+	uint32_t max_size;
+	uint32_t flash_size;
+	int write_delay; /* us per KiB */
+	int erase_delay; /* ms per data object */
+	int exec_delay;	 /* ms */
+	int reset_delay; /* ms from the EXECUTE completing an image to reset */
+	int boot_time;	 /* ms without answers after the reset */
+	int rate;		 /* link baud rate, 0 unlimited */
+	const char* stats_file;
+	uint32_t bl_version;
+	bool no_version; /* like bootloaders before SDK 15 */
+	bool prn_crc;	 /* notifications as CRC responses, like over BLE */
+	uint32_t part;
+	uint32_t variant;
+} opt = {
+	.mtu = 131,
+	.max_size = 4096,
+	.flash_size = 1024 * 1024,
+	.reset_delay = 20,
+	.boot_time = 100,
+	.bl_version = 1,
+	.part = 0x52840,
+	.variant = 0x41414430, /* "AAD0" */
+};
+
+/* received data of one object type. The device can't rewind within an
+ * object: CREATE goes back to the last executed one */
+struct emu_object {
+	uint8_t* data;
+	uint32_t offset;
+	uint32_t crc;
+	uint32_t end; /* of the created object */
+	uint32_t exec_offset;
+	uint32_t exec_crc;
+};
+
+static struct emu_object objects[3]; /* by nrf_dfu_obj_type_t */
+
+/* firmware reported by FIRMWARE_VERSION, from the init command of the last
+ * completely executed image */
+static struct {
+	bool app_valid;
+	uint32_t app_version;
+	uint32_t app_len;
+} device;
+static struct emu_object* cur;
+static uint16_t prn;
+static uint16_t prn_cnt;
+static int fd = -1;
+static volatile bool terminate;
+static uint64_t reset_time; /* us, 0 when no reset is pending */
+
+/* times in us. Setup is up to the first init command, init the transfer of
+ * init commands and data the rest up to the last executed data object */
+static struct {
+	uint32_t frames;
+	uint32_t writes;
+	uint32_t bytes;
+	uint32_t executed;
+	uint64_t start;
+	uint64_t phase_start;
+	uint64_t setup;
+	uint64_t init;
+	uint64_t data;
+} stats;
+
+static void emu_write(const uint8_t* buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG_ERR("Write error: %d %s", errno, strerror(errno));
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/* len: size of the response details */
+static void emu_respond(nrf_dfu_response_t* resp, size_t len)
+{
+	uint8_t buf[1 + sizeof(*resp)];
+	uint8_t enc[2 * sizeof(buf) + 1];
+	uint32_t enc_len;
+
+	buf[0] = NRF_DFU_OP_RESPONSE;
+	memcpy(buf + 1, resp, 2 + len);
+	slip_encode(enc, buf, 3 + len, &enc_len);
+	emu_write(enc, enc_len);
+}
+
+static void emu_result(nrf_dfu_op_t op, nrf_dfu_result_t res)
+{
+	nrf_dfu_response_t resp = {.request = op, .result = res};
+	emu_respond(&resp, 0);
+}
+
+static void emu_delay_ms(int ms)
+{
+	if (ms > 0) {
+		usleep(ms * 1000);
+	}
+}
+
+static struct emu_object* emu_object(uint8_t type)
+{
+	if (type == NRF_DFU_OBJ_TYPE_COMMAND || type == NRF_DFU_OBJ_TYPE_DATA) {
+		return &objects[type];
+	}
+	return NULL;
+}
+
+static void emu_select(nrf_dfu_request_t* req)
+{
+	struct emu_object* obj = emu_object(req->select.object_type);
+	if (obj == NULL) {
+		emu_result(req->request, NRF_DFU_RES_CODE_UNSUPPORTED_TYPE);
+		return;
+	}
+
+	cur = obj;
+	nrf_dfu_response_t resp = {
+		.request = req->request,
+		.result = NRF_DFU_RES_CODE_SUCCESS,
+		.select.max_size = htole32(req->select.object_type
+										   == NRF_DFU_OBJ_TYPE_COMMAND
+									   ? EMU_COMMAND_MAX_SIZE
+									   : opt.max_size),
+		.select.offset = htole32(obj->offset),
+		.select.crc = htole32(obj->crc),
+	};
+	emu_respond(&resp, sizeof(resp.select));
+}
+
+static void emu_create(nrf_dfu_request_t* req)
+{
+	uint8_t type = req->create.object_type;
+	uint32_t size = le32toh(req->create.object_size);
+	struct emu_object* obj = emu_object(type);
+
+	if (obj == NULL) {
+		emu_result(req->request, NRF_DFU_RES_CODE_UNSUPPORTED_TYPE);
+		return;
+	}
+
+	if (type == NRF_DFU_OBJ_TYPE_COMMAND) {
+		if (size > EMU_COMMAND_MAX_SIZE) {
+			emu_result(req->request, NRF_DFU_RES_CODE_INSUFFICIENT_RESOURCES);
+			return;
+		}
+		if (stats.setup == 0) {
+			stats.setup = time_us() - stats.start;
+		}
+		stats.phase_start = time_us();
+
+		/* a new init command starts a new firmware */
+		struct emu_object* fw = &objects[NRF_DFU_OBJ_TYPE_DATA];
+		fw->offset = fw->crc = fw->end = 0;
+		fw->exec_offset = fw->exec_crc = 0;
+		obj->exec_offset = obj->exec_crc = 0;
+	} else {
+		if (size > opt.max_size
+			|| obj->exec_offset + size > opt.flash_size) {
+			emu_result(req->request, NRF_DFU_RES_CODE_INSUFFICIENT_RESOURCES);
+			return;
+		}
+		/* erase */
+		emu_delay_ms(opt.erase_delay);
+	}
+
+	cur = obj;
+	obj->offset = obj->exec_offset;
+	obj->crc = obj->exec_crc;
+	obj->end = obj->offset + size;
+	prn_cnt = 0;
+	emu_result(req->request, NRF_DFU_RES_CODE_SUCCESS);
+}
+
+static void emu_data(const uint8_t* data, size_t len)
+{
+	if (cur == NULL || cur->offset + len > cur->end) {
+		/* there is no response to a write */
+		LOG_WARN("Write outside of object ignored");
+		return;
+	}
+
+	memcpy(cur->data + cur->offset, data, len);
+	cur->offset += len;
+	cur->crc = crc32(cur->crc, data, len);
+	stats.writes++;
+	stats.bytes += len;
+
+	if (opt.write_delay > 0) {
+		usleep((uint64_t)len * opt.write_delay / 1024);
+	}
+
+	if (prn > 0 && ++prn_cnt % prn == 0) {
+		/* both have the offset and CRC at the same place */
+		nrf_dfu_response_t resp = {
+			.request = opt.prn_crc ? NRF_DFU_OP_CRC_GET
+								   : NRF_DFU_OP_OBJECT_WRITE,
+			.result = NRF_DFU_RES_CODE_SUCCESS,
+			.write.offset = htole32(cur->offset),
+			.write.crc = htole32(cur->crc),
+		};
+		emu_respond(&resp, sizeof(resp.write));
+	}
+}
+
+static void emu_crc(nrf_dfu_request_t* req)
+{
+	if (cur == NULL) {
+		emu_result(req->request, NRF_DFU_RES_CODE_OPERATION_NOT_PERMITTED);
+		return;
+	}
+
+	nrf_dfu_response_t resp = {
+		.request = req->request,
+		.result = NRF_DFU_RES_CODE_SUCCESS,
+		.crc.offset = htole32(cur->offset),
+		.crc.crc = htole32(cur->crc),
+	};
+	emu_respond(&resp, sizeof(resp.crc));
+}
+
+/* the data object which completes the image of the init command was
+ * executed, true if it did */
+static bool emu_installed(void)
+{
+	struct emu_object* cmd = &objects[NRF_DFU_OBJ_TYPE_COMMAND];
+	uint32_t size = objects[NRF_DFU_OBJ_TYPE_DATA].exec_offset;
+	struct init_packet ip;
+
+	if (!init_packet_parse(cmd->data, cmd->exec_offset, &ip)
+		|| ip.sd_size + ip.bl_size + ip.app_size != size) {
+		return false;
+	}
+	if (!ip.has_fw_version) {
+		return true;
+	}
+
+	if (ip.type == IFT_APPLICATION && ip.app_size == size) {
+		device.app_valid = true;
+		device.app_version = ip.fw_version;
+		device.app_len = size;
+		LOG_NOTI("Application version %u installed", ip.fw_version);
+	} else if (ip.type == IFT_BOOTLOADER && ip.bl_size == size) {
+		opt.bl_version = ip.fw_version;
+		LOG_NOTI("Bootloader version %u installed", ip.fw_version);
+	}
+	return true;
+}
+
+static void emu_fw_version(nrf_dfu_request_t* req)
+{
+	nrf_dfu_response_t resp = {
+		.request = req->request,
+		.result = NRF_DFU_RES_CODE_SUCCESS,
+	};
+
+	/* image 0 is the bootloader, there is no SoftDevice */
+	if (req->firmware.image_number == 0) {
+		resp.firmware.type = NRF_DFU_FIRMWARE_TYPE_BOOTLOADER;
+		resp.firmware.version = htole32(opt.bl_version);
+		resp.firmware.addr = htole32(opt.flash_size);
+		resp.firmware.len = htole32(0x6000);
+	} else if (req->firmware.image_number == 1 && device.app_valid) {
+		resp.firmware.type = NRF_DFU_FIRMWARE_TYPE_APPLICATION;
+		resp.firmware.version = htole32(device.app_version);
+		resp.firmware.addr = htole32(0x1000);
+		resp.firmware.len = htole32(device.app_len);
+	} else {
+		emu_result(req->request, NRF_DFU_RES_CODE_INVALID_PARAMETER);
+		return;
+	}
+	emu_respond(&resp, sizeof(resp.firmware));
+}
+
+static void emu_hw_version(nrf_dfu_request_t* req)
+{
+	nrf_dfu_response_t resp = {
+		.request = req->request,
+		.result = NRF_DFU_RES_CODE_SUCCESS,
+		.hardware.part = htole32(opt.part),
+		.hardware.variant = htole32(opt.variant),
+		.hardware.memory.rom_size = htole32(opt.flash_size),
+		.hardware.memory.ram_size = htole32(256 * 1024),
+		.hardware.memory.rom_page_size = htole32(4096),
+	};
+	emu_respond(&resp, sizeof(resp.hardware));
+}
+
+static void emu_execute(nrf_dfu_request_t* req)
+{
+	if (cur == NULL || cur->offset != cur->end) {
+		emu_result(req->request, NRF_DFU_RES_CODE_OPERATION_NOT_PERMITTED);
+		return;
+	}
+
+	emu_delay_ms(opt.exec_delay);
+	cur->exec_offset = cur->offset;
+	cur->exec_crc = cur->crc;
+	stats.executed++;
+
+	uint64_t now = time_us();
+	if (cur == &objects[NRF_DFU_OBJ_TYPE_COMMAND]) {
+		stats.init += now - stats.phase_start;
+	} else {
+		stats.data += now - stats.phase_start;
+	}
+	stats.phase_start = now;
+	LOG_INF("Executed object (offset %u CRC 0x%X)", cur->offset, cur->crc);
+	if (cur == &objects[NRF_DFU_OBJ_TYPE_DATA] && emu_installed()) {
+		LOG_INF("Reset in %d ms", opt.reset_delay);
+		reset_time = now + (uint64_t)opt.reset_delay * 1000;
+	}
+	emu_result(req->request, NRF_DFU_RES_CODE_SUCCESS);
+}
+
+/* the device resets opt.reset_delay after an image is complete and doesn't
+ * answer for opt.boot_time. Then it is in the bootloader again, without
+ * the state of the last transfer. True while it doesn't answer */
+static bool emu_resetting(void)
+{
+	uint64_t now = time_us();
+
+	if (reset_time == 0 || now < reset_time) {
+		return false;
+	}
+	if (now < reset_time + (uint64_t)opt.boot_time * 1000) {
+		return true;
+	}
+
+	LOG_NOTI("Reset, bootloader started");
+	reset_time = 0;
+	cur = NULL;
+	prn = 0;
+	prn_cnt = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(objects); i++) {
+		uint8_t* data = objects[i].data;
+		memset(&objects[i], 0, sizeof(objects[i]));
+		objects[i].data = data;
+	}
+	return false;
+}
+
+/* length of the requests nrfdfu sends, 0 if not implemented here */
+static size_t emu_request_size(nrf_dfu_request_t* req)
+{
+	switch (req->request) {
+	case NRF_DFU_OP_OBJECT_CREATE:
+		return 1 + sizeof(req->create);
+	case NRF_DFU_OP_RECEIPT_NOTIF_SET:
+		return 1 + sizeof(req->prn);
+	case NRF_DFU_OP_OBJECT_SELECT:
+		return 1 + sizeof(req->select);
+	case NRF_DFU_OP_PING:
+		return 1 + sizeof(req->ping);
+	case NRF_DFU_OP_FIRMWARE_VERSION:
+		return opt.no_version ? 0 : 1 + sizeof(req->firmware);
+	case NRF_DFU_OP_HARDWARE_VERSION:
+		return opt.no_version ? 0 : 1;
+	case NRF_DFU_OP_MTU_GET:
+	case NRF_DFU_OP_CRC_GET:
+	case NRF_DFU_OP_OBJECT_EXECUTE:
+	case NRF_DFU_OP_ABORT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void emu_request(const uint8_t* buf, size_t len)
+{
+	nrf_dfu_request_t req = {};
+
+	stats.frames++;
+	if (stats.start == 0) {
+		stats.start = time_us();
+	}
+
+	if (buf[0] == NRF_DFU_OP_OBJECT_WRITE) {
+		emu_data(buf + 1, len - 1);
+		return;
+	}
+
+	memcpy(&req, buf, MIN(len, sizeof(req)));
+	size_t size = emu_request_size(&req);
+	if (size == 0) {
+		emu_result(req.request, NRF_DFU_RES_CODE_OP_CODE_NOT_SUPPORTED);
+		return;
+	}
+	if (size != len) {
+		emu_result(req.request, NRF_DFU_RES_CODE_INVALID_PARAMETER);
+		return;
+	}
+
+	LOG_INF("Request 0x%x", req.request);
+
+	switch (req.request) {
+	case NRF_DFU_OP_PING: {
+		nrf_dfu_response_t resp = {
+			.request = req.request,
+			.result = NRF_DFU_RES_CODE_SUCCESS,
+			.ping.id = req.ping.id,
+		};
+		emu_respond(&resp, sizeof(resp.ping));
+		break;
+	}
+	case NRF_DFU_OP_MTU_GET: {
+		nrf_dfu_response_t resp = {
+			.request = req.request,
+			.result = NRF_DFU_RES_CODE_SUCCESS,
+			.mtu.size = htole16(opt.mtu),
+		};
+		emu_respond(&resp, sizeof(resp.mtu));
+		break;
+	}
+	case NRF_DFU_OP_RECEIPT_NOTIF_SET:
+		prn = le16toh(req.prn.target);
+		emu_result(req.request, NRF_DFU_RES_CODE_SUCCESS);
+		break;
+	case NRF_DFU_OP_OBJECT_SELECT:
+		emu_select(&req);
+		break;
+	case NRF_DFU_OP_OBJECT_CREATE:
+		emu_create(&req);
+		break;
+	case NRF_DFU_OP_CRC_GET:
+		emu_crc(&req);
+		break;
+	case NRF_DFU_OP_OBJECT_EXECUTE:
+		emu_execute(&req);
+		break;
+	case NRF_DFU_OP_FIRMWARE_VERSION:
+		emu_fw_version(&req);
+		break;
+	case NRF_DFU_OP_HARDWARE_VERSION:
+		emu_hw_version(&req);
+		break;
+	case NRF_DFU_OP_ABORT:
+		/* the device would reset and start the application */
+		LOG_NOTI("Aborted");
+		emu_result(req.request, NRF_DFU_RES_CODE_SUCCESS);
+		break;
+	default:
+		break;
+	}
+}
+
+/* hold back reading like a UART at opt.rate would, 10 bits per byte */
+static void emu_link_delay(size_t len)
+{
+	static uint64_t link_free;
+	uint64_t now = time_us();
+
+	if (opt.rate <= 0) {
+		return;
+	}
+	link_free = MAX(link_free, now) + (uint64_t)len * 10000000 / opt.rate;
+	if (link_free > now) {
+		usleep(link_free - now);
+	}
+}
+
+static void emu_write_stats(void)
+{
+	FILE* f = fopen(opt.stats_file, "w");
+	if (f == NULL) {
+		LOG_ERR("Couldn't write '%s': %s", opt.stats_file, strerror(errno));
+		return;
+	}
+
+	fprintf(f,
+			"{\"frames\": %u, \"writes\": %u, \"bytes\": %u, "
+			"\"executed\": %u, \"setup_us\": %llu, \"init_us\": %llu, "
+			"\"data_us\": %llu}\n",
+			stats.frames, stats.writes, stats.bytes, stats.executed,
+			(unsigned long long)stats.setup, (unsigned long long)stats.init,
+			(unsigned long long)stats.data);
+	fclose(f);
+}
+
+/* open a pty which stays usable while nrfdfu closes and reopens it */
+static int emu_open_pty(void)
+{
+	struct termios tio;
+
+	int m = posix_openpt(O_RDWR | O_NOCTTY);
+	if (m < 0 || grantpt(m) != 0 || unlockpt(m) != 0) {
+		LOG_ERR("Couldn't open pty: %s", strerror(errno));
+		return -1;
+	}
+
+	/* keep the slave open, else reads fail with EIO while nrfdfu has not
+	 * opened it */
+	const char* name = ptsname(m);
+	int s = open(name, O_RDWR | O_NOCTTY);
+	if (s < 0) {
+		LOG_ERR("Couldn't open '%s': %s", name, strerror(errno));
+		close(m);
+		return -1;
+	}
+	tcgetattr(m, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(m, TCSANOW, &tio);
+
+	if (opt.link) {
+		unlink(opt.link);
+		if (symlink(name, opt.link) != 0) {
+			LOG_ERR("Couldn't link '%s': %s", opt.link, strerror(errno));
+		}
+	}
+
+	log_flush();
+	printf("%s\n", name);
+	fflush(stdout);
+	return m;
+}
+
+static void signal_handler(__attribute__((unused)) int signo)
+{
+	terminate = true;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"Usage: nrfdfu-emu [options]\n"
+			"Nordic serial DFU bootloader emulator on a pseudo terminal.\n"
+			"Prints the name of the pty, use it as nrfdfu serial -p <tty>\n"
+			"Options:\n"
+			"  -h, --help\t\tShow help\n"
+			"  -v, --verbose=<level>\tLog level 1 or 2 (-vv)\n"
+			"  -l, --link <path>\tSymlink to the pty\n"
+			"  -m, --mtu <num>\tMTU (131)\n"
+			"  -s, --max-size <num>\tMaximum data object size (4096)\n"
+			"  -f, --flash <num>\tFlash size for the firmware (1048576)\n"
+			"  -w, --write-delay <us>\tFlash write time per KiB (0)\n"
+			"  -e, --erase-delay <ms>\tFlash erase time per data object (0)\n"
+			"  -x, --exec-delay <ms>\tTime to execute an object (0)\n"
+			"  -d, --reset-delay <ms>\tTime from the last EXECUTE of an "
+			"image to reset (20)\n"
+			"  -t, --boot-time <ms>\tTime without answers after reset "
+			"(100)\n"
+			"  -r, --rate <baud>\tSimulated link baud rate (unlimited)\n"
+			"  -o, --stats <file>\tWrite statistics as JSON at exit\n"
+			"  -b, --bl-version <num>\tBootloader version (1)\n"
+			"  -n, --no-version\tNo FIRMWARE_VERSION and HARDWARE_VERSION "
+			"(SDK < 15)\n"
+			"  -c, --prn-crc\t\tPacket receipt notifications as CRC "
+			"responses (BLE)\n"
+			"  -P, --part <hex>\tHardware part (52840)\n"
+			"  -V, --variant <text>\tHardware variant (AAD0)\n");
+}
+
+static struct option options[] = {{"help", no_argument, NULL, 'h'},
+								  {"verbose", optional_argument, NULL, 'v'},
+								  {"link", required_argument, NULL, 'l'},
+								  {"mtu", required_argument, NULL, 'm'},
+								  {"max-size", required_argument, NULL, 's'},
+								  {"flash", required_argument, NULL, 'f'},
+								  {"write-delay", required_argument, NULL, 'w'},
+								  {"erase-delay", required_argument, NULL, 'e'},
+								  {"exec-delay", required_argument, NULL, 'x'},
+								  {"reset-delay", required_argument, NULL, 'd'},
+								  {"boot-time", required_argument, NULL, 't'},
+								  {"rate", required_argument, NULL, 'r'},
+								  {"stats", required_argument, NULL, 'o'},
+								  {"bl-version", required_argument, NULL, 'b'},
+								  {"no-version", no_argument, NULL, 'n'},
+								  {"prn-crc", no_argument, NULL, 'c'},
+								  {"part", required_argument, NULL, 'P'},
+								  {"variant", required_argument, NULL, 'V'},
+								  {NULL, 0, NULL, 0}};
+
+static void emu_options(int argc, char* argv[])
+{
+	int n;
+
+	conf.loglevel = LL_NOTICE;
+
+	const char* optstr = "hv::l:m:s:f:w:e:x:d:t:r:o:b:ncP:V:";
+	while ((n = getopt_long(argc, argv, optstr, options, NULL)) >= 0) {
+		switch (n) {
+		case 'h':
+			usage();
+			exit(EXIT_SUCCESS);
+		case 'v':
+			if (optarg == NULL)
+				conf.loglevel = LL_INFO;
+			else if (optarg[0] == 'v' || optarg[0] == '2')
+				conf.loglevel = LL_DEBUG;
+			break;
+		case 'l':
+			opt.link = optarg;
+			break;
+		case 'm':
+			opt.mtu = atoi(optarg);
+			break;
+		case 's':
+			opt.max_size = atoi(optarg);
+			break;
+		case 'f':
+			opt.flash_size = atoi(optarg);
+			break;
+		case 'w':
+			opt.write_delay = atoi(optarg);
+			break;
+		case 'e':
+			opt.erase_delay = atoi(optarg);
+			break;
+		case 'x':
+			opt.exec_delay = atoi(optarg);
+			break;
+		case 'd':
+			opt.reset_delay = atoi(optarg);
+			break;
+		case 't':
+			opt.boot_time = atoi(optarg);
+			break;
+		case 'r':
+			opt.rate = atoi(optarg);
+			break;
+		case 'o':
+			opt.stats_file = optarg;
+			break;
+		case 'b':
+			opt.bl_version = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			opt.no_version = true;
+			break;
+		case 'c':
+			opt.prn_crc = true;
+			break;
+		case 'P':
+			opt.part = strtoul(optarg, NULL, 16);
+			break;
+		case 'V':
+			/* four characters, most significant first like in the FICR */
+			opt.variant = 0;
+			for (int i = 0; i < 4 && optarg[i]; i++) {
+				opt.variant |= (uint32_t)optarg[i] << (24 - 8 * i);
+			}
+			break;
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (opt.mtu < 3 || opt.mtu > BUF_SIZE || opt.max_size == 0) {
+		LOG_ERR("Invalid MTU or object size");
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	uint8_t buf[SLIP_BUF_SIZE];
+	uint8_t frame[BUF_SIZE];
+	slip_t slip = {
+		.p_buffer = frame,
+		.buffer_len = 0,
+		.state = SLIP_STATE_DECODING,
+	};
+
+	emu_options(argc, argv);
+	/* frames longer than the MTU are dropped like on the device */
+	slip.buffer_len = opt.mtu;
+
+	objects[NRF_DFU_OBJ_TYPE_COMMAND].data = malloc(EMU_COMMAND_MAX_SIZE);
+	objects[NRF_DFU_OBJ_TYPE_DATA].data = malloc(opt.flash_size);
+	if (objects[NRF_DFU_OBJ_TYPE_COMMAND].data == NULL
+		|| objects[NRF_DFU_OBJ_TYPE_DATA].data == NULL) {
+		LOG_ERR("Out of memory");
+		return EXIT_FAILURE;
+	}
+
+	struct sigaction act = {.sa_handler = signal_handler};
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+
+	fd = emu_open_pty();
+	if (fd < 0) {
+		return EXIT_FAILURE;
+	}
+
+	while (!terminate) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG_ERR("Read error: %d %s", errno, strerror(errno));
+			break;
+		}
+		emu_link_delay(len);
+
+		for (ssize_t i = 0; i < len;) {
+			int ret;
+			i += slip_decode_buffer(&slip, buf + i, len - i, &ret);
+			if (ret == 1) {
+				if (slip.current_index > 0 && emu_resetting()) {
+					LOG_DBG("Frame dropped while resetting");
+				} else if (slip.current_index > 0) {
+					if (LOG_ENABLED(LL_DEBUG)) {
+						dump_data("RX: ", frame, slip.current_index);
+					}
+					emu_request(frame, slip.current_index);
+				}
+				slip.current_index = 0;
+			} else if (ret == -1) {
+				LOG_WARN("Frame longer than MTU dropped");
+				slip.current_index = 0;
+				slip.state = SLIP_STATE_DECODING;
+			}
+		}
+	}
+
+	if (stats.frames > 0) {
+		LOG_NOTI("%u frames, %u data writes, %u bytes, %u objects executed "
+				 "in %.3f sec",
+				 stats.frames, stats.writes, stats.bytes, stats.executed,
+				 (time_us() - stats.start) / 1000000.0);
+	}
+	if (opt.stats_file) {
+		emu_write_stats();
+	}
+
+	if (opt.link) {
+		unlink(opt.link);
+	}
+	close(fd);
+	free(objects[NRF_DFU_OBJ_TYPE_COMMAND].data);
+	free(objects[NRF_DFU_OBJ_TYPE_DATA].data);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,231 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "conf.h"
+#include "fleet.h"
+#include "log.h"
+#include "metrics.h"
+#include "prom.h"
+
+#ifndef __linux__
+
+bool fleet_upgrade(const struct dfu_image* img, int num_img)
+{
+	LOG_ERR("Fleet mode is only supported on Linux");
+	return false;
+}
+void fleet_stop(void)
+{
+}
+#else
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "dfu_sm.h"
+#include "serialtty.h"
+#include "util.h"
+
+#define FLEET_MAX_EVENTS 64
+
+/* state of the update of one device and what epoll knows of it */
+struct session {
+	struct dfu_sm sm;
+	unsigned int fd_gen; /* fd_gen of the registered fd */
+	bool out;			 /* registered for EPOLLOUT */
+};
+
+static int epfd = -1;
+static int wfd = -1; /* device node watch */
+static volatile sig_atomic_t terminate;
+
+/* follow the port being opened or closed and writes waiting, after every
+ * call into the state machine */
+static void session_sync(struct session* s)
+{
+	struct dfu_sm* sm = &s->sm;
+
+	/* closing the fd already removed it from epoll */
+	if (sm->fd < 0) {
+		return;
+	}
+
+	struct epoll_event ev = {
+		.events = EPOLLIN | (sm->want_write ? EPOLLOUT : 0),
+		.data.ptr = s,
+	};
+
+	if (s->fd_gen != sm->fd_gen) {
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, sm->fd, &ev) < 0) {
+			dfu_sm_fail(sm, "epoll error: %d %s", errno, strerror(errno));
+			return;
+		}
+		s->fd_gen = sm->fd_gen;
+		s->out = sm->want_write;
+	} else if (s->out != sm->want_write) {
+		epoll_ctl(epfd, EPOLL_CTL_MOD, sm->fd, &ev);
+		s->out = sm->want_write;
+	}
+}
+
+static void session_event(struct session* s, uint32_t events)
+{
+	struct dfu_sm* sm = &s->sm;
+
+	if (sm->fd >= 0 && (events & EPOLLIN)) {
+		dfu_sm_readable(sm);
+	}
+	if (sm->fd >= 0 && (events & EPOLLOUT)) {
+		dfu_sm_writable(sm);
+	}
+	if (sm->fd >= 0 && (events & (EPOLLERR | EPOLLHUP))) {
+		dfu_sm_hangup(sm);
+	}
+	session_sync(s);
+}
+
+bool fleet_upgrade(const struct dfu_image* img, int num_img)
+{
+	struct epoll_event events[FLEET_MAX_EVENTS];
+	struct session* sessions;
+	int nsess = conf.nports;
+	int ok = 0;
+
+	epfd = epoll_create1(0);
+	if (epfd < 0) {
+		LOG_ERR("epoll error: %d %s", errno, strerror(errno));
+		return false;
+	}
+
+	sessions = calloc(nsess, sizeof(*sessions));
+	if (sessions == NULL) {
+		LOG_ERR("Out of memory");
+		close(epfd);
+		return false;
+	}
+
+	wfd = serial_watch_init();
+	for (int i = 0; i < nsess; i++) {
+		if (strstr(conf.ports[i], "ACM") != NULL) {
+			serial_watch_add(wfd, conf.ports[i]);
+		}
+	}
+	if (wfd >= 0) {
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+		epoll_ctl(epfd, EPOLL_CTL_ADD, wfd, &ev);
+	}
+
+	for (int i = 0; i < nsess; i++) {
+		struct session* s = &sessions[i];
+		dfu_sm_init(&s->sm, conf.ports[i], img, num_img);
+		dfu_sm_start(&s->sm);
+		session_sync(s);
+	}
+
+	while (!terminate) {
+		uint64_t now = time_ms();
+		int timeout = -1;
+		int active = 0;
+
+		for (int i = 0; i < nsess; i++) {
+			struct dfu_sm* sm = &sessions[i].sm;
+			if (dfu_sm_finished(sm)) {
+				continue;
+			}
+			active++;
+			if (sm->deadline) {
+				int t = sm->deadline > now ? sm->deadline - now : 0;
+				if (timeout < 0 || t < timeout) {
+					timeout = t;
+				}
+			}
+		}
+		if (active == 0) {
+			break;
+		}
+
+		int n = epoll_wait(epfd, events, FLEET_MAX_EVENTS, timeout);
+		if (n < 0 && errno != EINTR) {
+			LOG_ERR("epoll error: %d %s", errno, strerror(errno));
+			break;
+		}
+		if (terminate) {
+			/* Ctrl-C, the timers must not count it as timeouts */
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct session* s = events[i].data.ptr;
+			if (s == NULL) {
+				/* device nodes created or changed */
+				serial_watch_drain(wfd);
+				for (int j = 0; j < nsess; j++) {
+					dfu_sm_node_changed(&sessions[j].sm);
+				}
+				continue;
+			}
+			session_event(s, events[i].events);
+		}
+
+		prom_tick();
+
+		now = time_ms();
+		for (int i = 0; i < nsess; i++) {
+			struct dfu_sm* sm = &sessions[i].sm;
+			if (sm->deadline && sm->deadline <= now && !dfu_sm_finished(sm)) {
+				dfu_sm_timer(sm);
+				session_sync(&sessions[i]);
+			}
+		}
+	}
+
+	for (int i = 0; i < nsess; i++) {
+		struct dfu_sm* sm = &sessions[i].sm;
+		if (sm->state == DS_DONE) {
+			ok++;
+		} else if (sm->state != DS_FAILED) {
+			LOG_ERR("%s: Aborted", sm->port);
+		}
+		metrics_count(sm->state == DS_DONE ? MC_UPDATES_OK : MC_UPDATES_FAILED,
+					  1);
+		dfu_sm_close(sm);
+	}
+
+	LOG_NOTI("Updated %d of %d devices", ok, nsess);
+
+	free(sessions);
+	if (wfd >= 0) {
+		close(wfd);
+		wfd = -1;
+	}
+	close(epfd);
+	epfd = -1;
+	return ok == nsess;
+}
+
+void fleet_stop(void)
+{
+	terminate = true;
+}
+
+#endif
@@ -0,0 +1,178 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+
+#include "initpkt.h"
+
+/* protobuf wire types */
+enum { WT_VARINT = 0, WT_FIXED64 = 1, WT_BYTES = 2, WT_FIXED32 = 5 };
+
+/* field numbers of dfu-cc.proto */
+#define PACKET_COMMAND		  1
+#define PACKET_SIGNED_COMMAND 2
+#define SIGNED_COMMAND		  1
+#define COMMAND_INIT		  2
+#define INIT_FW_VERSION		  1
+#define INIT_HW_VERSION		  2
+#define INIT_TYPE			  4
+#define INIT_SD_SIZE		  5
+#define INIT_BL_SIZE		  6
+#define INIT_APP_SIZE		  7
+#define INIT_IS_DEBUG		  9
+
+struct pb_field {
+	uint32_t num;
+	int type;
+	uint64_t val;
+	const uint8_t* data;
+	size_t len;
+};
+
+static bool pb_varint(const uint8_t** p, const uint8_t* end, uint64_t* val)
+{
+	*val = 0;
+	for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+		uint8_t b = *(*p)++;
+		*val |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* read the next field of a message, the value of length delimited fields is
+ * not copied */
+static bool pb_next(const uint8_t** p, const uint8_t* end, struct pb_field* f)
+{
+	uint64_t key;
+	if (!pb_varint(p, end, &key) || key >> 3 == 0 || key >> 3 > UINT32_MAX) {
+		return false;
+	}
+	f->num = key >> 3;
+	f->type = key & 7;
+
+	switch (f->type) {
+	case WT_VARINT:
+		return pb_varint(p, end, &f->val);
+	case WT_BYTES:
+		if (!pb_varint(p, end, &f->val) || f->val > (uint64_t)(end - *p)) {
+			return false;
+		}
+		f->data = *p;
+		f->len = f->val;
+		*p += f->len;
+		return true;
+	case WT_FIXED64:
+	case WT_FIXED32:
+		f->len = f->type == WT_FIXED64 ? 8 : 4;
+		if (f->len > (size_t)(end - *p)) {
+			return false;
+		}
+		*p += f->len;
+		return true;
+	default:
+		/* groups are not used by dfu-cc.proto */
+		return false;
+	}
+}
+
+/* find the embedded message of field num, the last one wins */
+static bool pb_message(const uint8_t* data, size_t len, uint32_t num,
+					   const uint8_t** msg, size_t* msg_len)
+{
+	const uint8_t* p = data;
+	const uint8_t* end = data + len;
+	struct pb_field f;
+	bool found = false;
+
+	while (p < end) {
+		if (!pb_next(&p, end, &f)) {
+			return false;
+		}
+		if (f.num == num && f.type == WT_BYTES) {
+			*msg = f.data;
+			*msg_len = f.len;
+			found = true;
+		}
+	}
+	return found;
+}
+
+bool init_packet_parse(const uint8_t* dat, size_t len, struct init_packet* ip)
+{
+	const uint8_t* cmd;
+	size_t cmd_len;
+	const uint8_t* init;
+	size_t init_len;
+
+	memset(ip, 0, sizeof(*ip));
+
+	if (pb_message(dat, len, PACKET_SIGNED_COMMAND, &cmd, &cmd_len)) {
+		if (!pb_message(cmd, cmd_len, SIGNED_COMMAND, &cmd, &cmd_len)) {
+			return false;
+		}
+	} else if (!pb_message(dat, len, PACKET_COMMAND, &cmd, &cmd_len)) {
+		return false;
+	}
+
+	if (!pb_message(cmd, cmd_len, COMMAND_INIT, &init, &init_len)) {
+		return false;
+	}
+
+	const uint8_t* p = init;
+	const uint8_t* end = init + init_len;
+	struct pb_field f;
+	while (p < end) {
+		if (!pb_next(&p, end, &f)) {
+			return false;
+		}
+		if (f.type != WT_VARINT) {
+			continue;
+		}
+		switch (f.num) {
+		case INIT_FW_VERSION:
+			ip->has_fw_version = true;
+			ip->fw_version = f.val;
+			break;
+		case INIT_HW_VERSION:
+			ip->has_hw_version = true;
+			ip->hw_version = f.val;
+			break;
+		case INIT_TYPE:
+			ip->type = f.val;
+			break;
+		case INIT_SD_SIZE:
+			ip->sd_size = f.val;
+			break;
+		case INIT_BL_SIZE:
+			ip->bl_size = f.val;
+			break;
+		case INIT_APP_SIZE:
+			ip->app_size = f.val;
+			break;
+		case INIT_IS_DEBUG:
+			ip->is_debug = f.val != 0;
+			break;
+		}
+	}
+	return true;
+}
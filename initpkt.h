@@ -0,0 +1,53 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef INITPKT_H
+#define INITPKT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* FwType of dfu-cc.proto, differs from nrf_dfu_firmware_type_t */
+enum init_fw_type {
+	IFT_APPLICATION,
+	IFT_SOFTDEVICE,
+	IFT_BOOTLOADER,
+	IFT_SOFTDEVICE_BOOTLOADER,
+	IFT_EXTERNAL_APPLICATION,
+};
+
+/* fields of the InitCommand in the init packet (.dat) of an image */
+struct init_packet {
+	bool has_fw_version;
+	uint32_t fw_version;
+	bool has_hw_version;
+	uint32_t hw_version;
+	enum init_fw_type type;
+	uint32_t sd_size;
+	uint32_t bl_size;
+	uint32_t app_size;
+	bool is_debug;
+};
+
+/* decode the protobuf of a plain or signed init packet */
+bool init_packet_parse(const uint8_t* dat, size_t len, struct init_packet* ip);
+
+#endif
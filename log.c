@@ -17,26 +17,197 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "conf.h"
 #include "log.h"
+#include "util.h"
+
+/*
+ * Messages are formatted into a ring buffer and written to stdout by a
+ * background thread, so a slow console or pipe does not stall the DFU
+ * transfer. There is one producer, the main thread, and one consumer, so
+ * head and tail need no lock. Nothing may be logged from a signal handler,
+ * it could interrupt log_put() between reading and storing the head.
+ */
+#define LOG_BUF_SIZE 65536
+#define LOG_LINE_MAX 2048
+
+static char log_buf[LOG_BUF_SIZE];
+static atomic_size_t log_head;
+static atomic_size_t log_tail;
+static atomic_uint log_dropped;
+static atomic_bool log_stop;
+static sem_t log_sem;
+static pthread_t log_thread;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static bool log_async;
+
+static char last_error[200];
+
+static void log_write(const char* buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(STDOUT_FILENO, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return; /* output is gone, discard */
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void log_drain(void)
+{
+	size_t tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&log_head, memory_order_acquire);
+
+	while (tail != head) {
+		size_t off = tail % LOG_BUF_SIZE;
+		size_t len = MIN(head - tail, LOG_BUF_SIZE - off);
+		log_write(log_buf + off, len);
+		tail += len;
+		atomic_store_explicit(&log_tail, tail, memory_order_release);
+		head = atomic_load_explicit(&log_head, memory_order_acquire);
+	}
+
+	unsigned dropped = atomic_exchange(&log_dropped, 0);
+	if (dropped > 0) {
+		char msg[64];
+		int len = snprintf(msg, sizeof(msg), "[%u log messages dropped]\n",
+						   dropped);
+		log_write(msg, len);
+	}
+}
+
+static void* log_writer(__attribute__((unused)) void* arg)
+{
+	while (!atomic_load(&log_stop)) {
+		if (sem_wait(&log_sem) == 0) {
+			log_drain();
+		}
+	}
+	log_drain();
+	return NULL;
+}
+
+static void log_fini(void)
+{
+	atomic_store(&log_stop, true);
+	sem_post(&log_sem);
+	pthread_join(log_thread, NULL);
+}
+
+static void log_start(void)
+{
+	sigset_t all, old;
+
+	if (sem_init(&log_sem, 0, 0) != 0) {
+		return;
+	}
+
+	/* signals are handled by the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	log_async = pthread_create(&log_thread, NULL, log_writer, NULL) == 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (log_async) {
+		atexit(log_fini);
+	}
+}
+
+static void log_put(enum loglevel level, const char* buf, size_t len)
+{
+	pthread_once(&log_once, log_start);
+	if (!log_async) {
+		log_write(buf, len);
+		return;
+	}
+
+	size_t head = atomic_load_explicit(&log_head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&log_tail, memory_order_acquire);
+	while (LOG_BUF_SIZE - (head - tail) < len) {
+		if (level > LL_WARN) {
+			atomic_fetch_add(&log_dropped, 1);
+			return;
+		}
+		/* errors and warnings are never dropped, wait for space */
+		sem_post(&log_sem);
+		nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+		tail = atomic_load_explicit(&log_tail, memory_order_acquire);
+	}
+
+	size_t off = head % LOG_BUF_SIZE;
+	size_t first = MIN(len, LOG_BUF_SIZE - off);
+	memcpy(log_buf + off, buf, first);
+	memcpy(log_buf, buf + first, len - first);
+	atomic_store_explicit(&log_head, head + len, memory_order_release);
+	sem_post(&log_sem);
+}
+
+void log_flush(void)
+{
+	if (!log_async) {
+		return;
+	}
+	sem_post(&log_sem);
+	while (atomic_load(&log_tail) != atomic_load(&log_head)) {
+		nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+	}
+}
 
 void __attribute__((format(printf, 3, 4)))
 log_out(enum loglevel level, bool nl, const char* format, ...)
 {
+	char line[LOG_LINE_MAX];
 	va_list args;
+	int len;
+
+	if (level <= LL_ERR) {
+		va_start(args, format);
+		vsnprintf(last_error, sizeof(last_error), format, args);
+		va_end(args);
+	}
 
 	if (conf.loglevel < level) {
 		return;
 	}
 
+	/* leave room for the newline, longer messages are truncated */
 	va_start(args, format);
-	vprintf(format, args);
+	len = vsnprintf(line, sizeof(line) - 1, format, args);
+	va_end(args);
+	if (len < 0) {
+		return;
+	}
+	len = MIN(len, (int)sizeof(line) - 2);
 	if (nl || conf.loglevel > level) {
-		printf("\n");
+		line[len++] = '\n';
 	}
 
-	va_end(args);
+	log_put(level, line, len);
+}
+
+const char* log_last_error(void)
+{
+	/* messages may start with a newline after progress dots */
+	const char* s = last_error;
+	while (*s == '\n') {
+		s++;
+	}
+	return *s ? s : NULL;
 }
@@ -25,28 +25,38 @@
 /* these conincide with syslog levels for convenience */
 enum loglevel { LL_CRIT = 2, LL_ERR, LL_WARN, LL_NOTICE, LL_INFO, LL_DEBUG };
 
+/* highest level compiled in, messages above it cost nothing at runtime */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LL_DEBUG
+#endif
+
+/* level is compiled in and enabled, for guarding expensive debug output */
+#define LOG_ENABLED(lvl) ((lvl) <= LOG_LEVEL_MAX && conf.loglevel >= (lvl))
+
 void __attribute__((format(printf, 3, 4)))
 log_out(enum loglevel ll, bool nl, const char* fmt, ...);
+/* wait until all messages are written to stdout */
+void log_flush(void);
+/* last error message, or NULL */
+const char* log_last_error(void);
 
-#ifndef DEBUG
-#define DEBUG 1
-#endif
-
-#define LOG_CRIT(...)  log_out(LL_CRIT, true, __VA_ARGS__)
-#define LOG_ERR(...)   log_out(LL_ERR, true, __VA_ARGS__)
-#define LOG_WARN(...)  log_out(LL_WARN, true, __VA_ARGS__)
-#define LOG_NOTI(...)  log_out(LL_NOTICE, true, __VA_ARGS__)
-#define LOG_NOTI_(...) log_out(LL_NOTICE, false, __VA_ARGS__)
-#define LOG_INF(...)   log_out(LL_INFO, true, __VA_ARGS__)
-#define LOG_INF_(...)  log_out(LL_INFO, false, __VA_ARGS__)
-#define LOG_DBG(...)                                                           \
+#define LOG_AT(lvl, nl, ...)                                                   \
 	do {                                                                       \
-		if (DEBUG)                                                             \
-			log_out(LL_DEBUG, true, __VA_ARGS__);                              \
+		if ((lvl) <= LOG_LEVEL_MAX)                                            \
+			log_out(lvl, nl, __VA_ARGS__);                                     \
 	} while (0)
+
+#define LOG_CRIT(...)  LOG_AT(LL_CRIT, true, __VA_ARGS__)
+#define LOG_ERR(...)   LOG_AT(LL_ERR, true, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LL_WARN, true, __VA_ARGS__)
+#define LOG_NOTI(...)  LOG_AT(LL_NOTICE, true, __VA_ARGS__)
+#define LOG_NOTI_(...) LOG_AT(LL_NOTICE, false, __VA_ARGS__)
+#define LOG_INF(...)   LOG_AT(LL_INFO, true, __VA_ARGS__)
+#define LOG_INF_(...)  LOG_AT(LL_INFO, false, __VA_ARGS__)
+#define LOG_DBG(...)   LOG_AT(LL_DEBUG, true, __VA_ARGS__)
 #define LOG_DBGL(lvl, ...)                                                     \
 	do {                                                                       \
-		if (DEBUG && conf.loglevel >= lvl)                                     \
+		if (LOG_ENABLED(lvl))                                                  \
 			log_out(LL_DEBUG, true, __VA_ARGS__);                              \
 	} while (0)
 #define LOG_NL(lvl)                                                            \
@@ -18,31 +18,54 @@
  */
 
 #define _GNU_SOURCE
+#include <ctype.h>
 #include <getopt.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include <json-c/json.h>
 #include <zip.h>
 
+#include "cache.h"
+#include "capture.h"
 #include "conf.h"
 #include "dfu.h"
-#include "dfu_ble.h"
 #include "dfu_serial.h"
+#include "dfu_transport.h"
+#include "fleet.h"
 #include "log.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "progress.h"
+#include "prom.h"
 #include "serialtty.h"
 #include "util.h"
 
+/* package directory in a bundle, "<part>-<variant>" or "<part>" */
+#define BUNDLE_DIR_LEN 24
+#define BUNDLE_DIRS	   2
+
 struct config conf;
+static const struct dfu_transport* transport;
+static struct progress progress;
 
 static struct option ser_options[] = {{"help", no_argument, NULL, 'h'},
 									  {"verbose", optional_argument, NULL, 'v'},
 									  {"port", required_argument, NULL, 'p'},
 									  {"baud", required_argument, NULL, 'b'},
+									  {"dfu-baud", required_argument, NULL, 'B'},
 									  {"cmd", required_argument, NULL, 'c'},
 									  {"hexcmd", required_argument, NULL, 'C'},
 									  {"timeout", required_argument, NULL, 't'},
+									  {"prn", required_argument, NULL, 'n'},
+									  {"metrics", required_argument, NULL, 'm'},
+									  {"progress", required_argument, NULL, 'P'},
+									  {"prometheus", required_argument, NULL, 'R'},
+									  {"capture", required_argument, NULL, 'W'},
+									  {"cache", required_argument, NULL, 'K'},
+									  {"force", no_argument, NULL, 'F'},
 									  {NULL, 0, NULL, 0}};
 
 static struct option ble_options[] = {{"help", no_argument, NULL, 'h'},
@@ -51,6 +74,13 @@ static struct option ble_options[] = {{"help", no_argument, NULL, 'h'},
 									  {"atype", optional_argument, NULL, 't'},
 									  {"intf", optional_argument, NULL, 'i'},
 									  {"passkey", required_argument, NULL, 'p'},
+									  {"prn", required_argument, NULL, 'n'},
+									  {"metrics", required_argument, NULL, 'm'},
+									  {"progress", required_argument, NULL, 'P'},
+									  {"prometheus", required_argument, NULL, 'R'},
+									  {"capture", required_argument, NULL, 'W'},
+									  {"cache", required_argument, NULL, 'K'},
+									  {"force", no_argument, NULL, 'F'},
 									  {NULL, 0, NULL, 0}};
 
 static void usage(void)
@@ -61,17 +91,33 @@ static void usage(void)
 #else
 			"Usage: nrfdfu serial [options] DFUPKG.zip\n"
 #endif
+			"       nrfdfu fleet [options] -p <tty> [-p <tty>...] DFUPKG.zip\n"
 			"Nordic NRF DFU Upgrade with DFUPKG.zip\n"
 			"Options (all):\n"
 			"  -h, --help\t\tShow help\n"
 			"  -v, --verbose=<level>\tLog level 1 or 2 (-vv)\n"
+			"  -n, --prn <num>\tPacket receipt notification every <num> "
+			"packets (0)\n"
+			"  -m, --metrics <file>\tWrite latencies and counters as JSON\n"
+			"  --progress=jsonl[:<fd>] Progress as JSON lines to stdout or "
+			"<fd>\n"
+			"  --prometheus=<file>\tWrite metrics for the Prometheus textfile "
+			"collector\n"
+			"  --capture=<file>\tWrite all DFU frames to a pcapng file\n"
+			"  --cache=<dir>\t\tKeep decompressed images in <dir>\n"
+			"  --force\t\tUpdate images the device already runs\n"
 			"\n"
 			"Options (serial):\n"
 			"  -p, --port <tty>\tSerial port (/dev/ttyUSB0)\n"
-			"  -b, --baud <num>\tSerial baud rate (115200)\n"
+			"  -b, --baud <num>\tSerial baud rate for DFU command (115200)\n"
+			"  -B, --dfu-baud <num>\tSerial baud rate of bootloader (115200)\n"
 			"  -c, --cmd <text>\tCommand to enter DFU mode\n"
 			"  -C, --hexcmd <hex>\tCommand to enter DFU mode in HEX\n"
-			"  -t, --timeout <num>\tTimeout after <num> tries (60)\n"
+			"  -t, --timeout <num>\tTimeout after <num> seconds (10)\n"
+			"\n"
+			"Options (fleet):\n"
+			"  Same as serial, -p can be repeated and more ports can be\n"
+			"  given before DFUPKG.zip. All ports are updated at once\n"
 #ifdef BLE_SUPPORT
 			"\n"
 			"Options (BLE):\n"
@@ -83,11 +129,35 @@ static void usage(void)
 	);
 }
 
+static void add_port(char* port)
+{
+	char** ports = realloc(conf.ports, (conf.nports + 1) * sizeof(char*));
+	if (ports == NULL) {
+		LOG_ERR("Out of memory");
+		exit(EXIT_FAILURE);
+	}
+	conf.ports = ports;
+	conf.ports[conf.nports++] = port;
+}
+
+/* transmit times are divided by the baud rate */
+static int parse_baud(const char* arg)
+{
+	char* end;
+	long baud = strtol(arg, &end, 10);
+	if (end == arg || *end != '\0' || baud <= 0 || baud > INT_MAX) {
+		LOG_ERR("Invalid baud rate '%s'", arg);
+		exit(EXIT_FAILURE);
+	}
+	return baud;
+}
+
 static void main_options(int argc, char* argv[])
 {
 	/* defaults */
 	conf.serport = "/dev/ttyUSB0";
 	conf.serspeed = 115200;
+	conf.dfuspeed = DFU_SERIAL_BAUDRATE;
 	conf.ser_acm = false;
 	conf.loglevel = LL_NOTICE;
 	conf.timeout = 10;
@@ -104,6 +174,9 @@ static void main_options(int argc, char* argv[])
 	const char* type = argv[1];
 	if (strncasecmp(argv[1], "ser", 3) == 0) {
 		conf.dfu_type = DFU_SERIAL;
+	} else if (strcasecmp(argv[1], "fleet") == 0) {
+		conf.dfu_type = DFU_SERIAL;
+		conf.fleet = true;
 	} else if (strncasecmp(argv[1], "ble", 3) == 0) {
 		conf.dfu_type = DFU_BLE;
 #ifndef BLE_SUPPORT
@@ -119,9 +192,9 @@ static void main_options(int argc, char* argv[])
 	int n = 0;
 	while (n >= 0) {
 		if (conf.dfu_type == DFU_SERIAL) {
-			n = getopt_long(argc, argv, "hv::p:b:c:C:t:", ser_options, NULL);
+			n = getopt_long(argc, argv, "hv::p:b:B:c:C:t:n:m:", ser_options, NULL);
 		} else {
-			n = getopt_long(argc, argv, "hv::a:t:i:p:", ble_options, NULL);
+			n = getopt_long(argc, argv, "hv::a:t:i:p:n:m:", ble_options, NULL);
 		}
 
 		if (n < 0)
@@ -139,7 +212,9 @@ static void main_options(int argc, char* argv[])
 				conf.loglevel = LL_DEBUG;
 			break;
 		case 'p':
-			if (conf.dfu_type == DFU_SERIAL) {
+			if (conf.fleet) {
+				add_port(optarg);
+			} else if (conf.dfu_type == DFU_SERIAL) {
 				conf.serport = optarg;
 				if (strstr(conf.serport, "ACM") != NULL) {
 					conf.ser_acm = true;
@@ -149,7 +224,10 @@ static void main_options(int argc, char* argv[])
 			}
 			break;
 		case 'b':
-			conf.serspeed = atoi(optarg);
+			conf.serspeed = parse_baud(optarg);
+			break;
+		case 'B':
+			conf.dfuspeed = parse_baud(optarg);
 			break;
 		case 'c':
 			conf.dfucmd = optarg;
@@ -169,6 +247,36 @@ static void main_options(int argc, char* argv[])
 				}
 			}
 			break;
+		case 'n': {
+			char* end;
+			long prn = strtol(optarg, &end, 10);
+			if (*end != '\0' || prn < 0 || prn > UINT16_MAX) {
+				LOG_ERR("Invalid PRN '%s' (0 to %d)", optarg, UINT16_MAX);
+				exit(EXIT_FAILURE);
+			}
+			conf.prn = prn;
+			break;
+		}
+		case 'm':
+			conf.metrics_file = optarg;
+			break;
+		case 'P':
+			if (!progress_init(optarg)) {
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'R':
+			conf.prom_file = optarg;
+			break;
+		case 'W':
+			conf.capture_file = optarg;
+			break;
+		case 'K':
+			conf.cache_dir = optarg;
+			break;
+		case 'F':
+			conf.force = true;
+			break;
 		case 'a':
 			conf.ble_addr = optarg;
 			break;
@@ -187,6 +295,20 @@ static void main_options(int argc, char* argv[])
 		LOG_ERR("ZIP file missing");
 		exit(EXIT_FAILURE);
 	}
+
+	/* in fleet mode the other non-option arguments are ports, so that
+	 * "-p /dev/ttyUSB*" works */
+	if (conf.fleet) {
+		for (int i = optind; i < argc - 1; i++) {
+			if (strcmp(argv[i], type) != 0) {
+				add_port(argv[i]);
+			}
+		}
+		if (conf.nports == 0) {
+			LOG_ERR("No ports given");
+			exit(EXIT_FAILURE);
+		}
+	}
 }
 
 static zip_file_t* zip_file_open(zip_t* zip, const char* name, size_t* size)
@@ -209,113 +331,282 @@ static zip_file_t* zip_file_open(zip_t* zip, const char* name, size_t* size)
 	return zf;
 }
 
-/* ap_dat and ap_bin have to be freed by caller */
-static bool read_manifest(zip_t* zip, char** ap_dat, char** ap_bin,
-						  char** sb_dat, char** sb_bin)
+/* read whole file from ZIP, returned buffer has to be freed by caller */
+static uint8_t* zip_file_read(zip_t* zip, const char* name, size_t* size)
+{
+	zip_file_t* zf = zip_file_open(zip, name, size);
+	if (zf == NULL) {
+		return NULL;
+	}
+
+	uint8_t* data = malloc(*size);
+	if (data && zip_fread(zf, data, *size) != (zip_int64_t)*size) {
+		LOG_ERR("Could not read %s from ZIP file", name);
+		free(data);
+		data = NULL;
+	}
+
+	zip_fclose(zf);
+	return data;
+}
+
+/* name of a file in the package directory of a bundle, dir is NULL for a
+ * plain package */
+static const char* package_path(const char* dir, const char* file, char* buf,
+								size_t len)
+{
+	if (dir == NULL) {
+		return file;
+	}
+	snprintf(buf, len, "%s/%s", dir, file);
+	return buf;
+}
+
+/* decompress the init packet and firmware of an image into memory once, so
+ * sending, CRC checks and resuming only work on buffers */
+static bool image_load(zip_t* zip, const char* dir, const char* name,
+					   const char* dat, const char* bin, struct dfu_image* img)
+{
+	char path[BUNDLE_DIR_LEN + MANIFEST_NAME_LEN];
+
+	img->name = name;
+	img->dat = zip_file_read(zip, package_path(dir, dat, path, sizeof(path)),
+							 &img->dat_size);
+	img->bin = zip_file_read(zip, package_path(dir, bin, path, sizeof(path)),
+							 &img->bin_size);
+	if (img->dat == NULL || img->bin == NULL) {
+		return false;
+	}
+
+	/* CRC prefixes, so resuming does not read the image again */
+	img->dat_crcs = dfu_crc_table(img->dat, img->dat_size);
+	img->bin_crcs = dfu_crc_table(img->bin, img->bin_size);
+	return img->dat_crcs != NULL && img->bin_crcs != NULL;
+}
+
+/* size of a file in the package, false if it is missing */
+static bool zip_file_size(zip_t* zip, const char* dir, const char* file,
+						  size_t* size)
 {
-	bool ret = false;
-	char buf[600];
-	json_object* json = NULL;
-	json_object* jobj;
-	json_object* jobj2;
-	json_object* jobj3;
-	enum json_tokener_error json_err;
-
-	zip_file_t* zf = zip_fopen(zip, "manifest.json", 0);
+	char buf[BUNDLE_DIR_LEN + MANIFEST_NAME_LEN];
+	const char* path = package_path(dir, file, buf, sizeof(buf));
+	struct zip_stat stat;
+
+	zip_stat_init(&stat);
+	if (zip_stat(zip, path, 0, &stat) < 0) {
+		LOG_ERR("ZIP file does not contain %s", path);
+		return false;
+	}
+	*size = stat.size;
+	return true;
+}
+
+/* parse manifest.json in pieces, it can have any size. The images are in
+ * update order and have the sizes of their files */
+static bool read_manifest(zip_t* zip, const char* dir, struct manifest* m)
+{
+	struct manifest_parser parser;
+	char path[BUNDLE_DIR_LEN + sizeof("/manifest.json")];
+	char buf[256];
+	zip_int64_t len;
+	bool ret = true;
+
+	zip_file_t* zf = zip_fopen(
+		zip, package_path(dir, "manifest.json", path, sizeof(path)), 0);
 	if (zf == NULL) {
 		LOG_ERR("ZIP file does not contain manifest");
 		return false;
 	}
 
-	zip_int64_t len = zip_fread(zf, buf, sizeof(buf));
-	if (len <= 0) {
+	manifest_init(&parser);
+	while (ret && (len = zip_fread(zf, buf, sizeof(buf))) > 0) {
+		ret = manifest_feed(&parser, buf, len);
+	}
+	if (len < 0) {
 		LOG_ERR("Could not read Manifest");
-		goto exit;
+		ret = false;
 	}
 
-	/* read JSON */
+	zip_fclose(zf);
+	if (!ret || !manifest_finish(&parser, m)) {
+		return false;
+	}
 
-	json = json_tokener_parse_verbose(buf, &json_err);
-	if (json == NULL) {
-		LOG_ERR("Manifest not valid JSON %d", json_err);
-		goto exit;
+	for (int i = 0; i < m->num; i++) {
+		struct manifest_image* mi = &m->images[i];
+		if (!zip_file_size(zip, dir, mi->dat_file, &mi->dat_size)
+			|| !zip_file_size(zip, dir, mi->bin_file, &mi->bin_size)) {
+			return false;
+		}
+		LOG_INF("Manifest: %s %s (%zu bytes) %s (%zu bytes)",
+				manifest_type_name(mi->type), mi->dat_file, mi->dat_size,
+				mi->bin_file, mi->bin_size);
 	}
+	return true;
+}
 
-	if (!json_object_object_get_ex(json, "manifest", &jobj)) {
-		LOG_ERR("Manifest format unknown");
-		goto exit;
+static void images_free(struct dfu_image* img, int num)
+{
+	for (int i = 0; i < num; i++) {
+		free(img[i].dat);
+		free(img[i].dat_crcs);
+		free(img[i].bin);
+		free(img[i].bin_crcs);
 	}
+}
 
-	if (json_object_object_get_ex(jobj, "application", &jobj2)) {
-		if (json_object_object_get_ex(jobj2, "dat_file", &jobj3)) {
-			*ap_dat = strdup(json_object_get_string(jobj3));
-		}
-		if (json_object_object_get_ex(jobj2, "bin_file", &jobj3)) {
-			*ap_bin = strdup(json_object_get_string(jobj3));
-		}
-		if (!*ap_dat || !*ap_bin) {
-			LOG_ERR("Manifest missing app files");
-			goto exit;
-		}
+/* read the manifest and decompress all images of the package, or of the
+ * package in dir of a bundle. Returns the number of images, or 0 on error */
+static int package_load(const char* file, const char* dir,
+						struct dfu_image* img)
+{
+	struct manifest m;
+	int num = 0;
+
+	zip_t* zip = zip_open(file, ZIP_RDONLY, NULL);
+	if (zip == NULL) {
+		LOG_ERR("Could not open ZIP file '%s'", file);
+		return 0;
 	}
 
-	if ((json_object_object_get_ex(jobj, "softdevice_bootloader", &jobj2)
-		 || json_object_object_get_ex(jobj, "bootloader", &jobj2))) {
-		if (json_object_object_get_ex(jobj2, "dat_file", &jobj3)) {
-			*sb_dat = strdup(json_object_get_string(jobj3));
+	if (read_manifest(zip, dir, &m)) {
+		for (num = 0; num < m.num; num++) {
+			const struct manifest_image* mi = &m.images[num];
+			if (!image_load(zip, dir, manifest_type_name(mi->type),
+							mi->dat_file, mi->bin_file, &img[num])) {
+				LOG_ERR("Cannot read %s files in ZIP",
+						manifest_type_name(mi->type));
+				images_free(img, num + 1);
+				num = 0;
+				break;
+			}
 		}
-		if (json_object_object_get_ex(jobj2, "bin_file", &jobj3)) {
-			*sb_bin = strdup(json_object_get_string(jobj3));
+	}
+
+	zip_close(zip);
+	return num;
+}
+
+/* A bundle has no manifest of its own but a package in a directory for each
+ * hardware version of the devices */
+static bool package_is_bundle(const char* file)
+{
+	bool bundle = false;
+
+	zip_t* zip = zip_open(file, ZIP_RDONLY, NULL);
+	if (zip == NULL) {
+		/* reported when loading the package */
+		return false;
+	}
+
+	if (zip_name_locate(zip, "manifest.json", 0) < 0) {
+		zip_int64_t num = zip_get_num_entries(zip, 0);
+		for (zip_int64_t i = 0; i < num && !bundle; i++) {
+			const char* name = zip_get_name(zip, i, 0);
+			const char* slash = name ? strchr(name, '/') : NULL;
+			bundle = slash && strcmp(slash, "/manifest.json") == 0;
 		}
-		if (!*sb_dat || !*sb_bin) {
-			LOG_ERR("Manifest missing softdevice/bootloader files");
-			goto exit;
+	}
+
+	zip_close(zip);
+	return bundle;
+}
+
+/* the package directories for the device, in the order they are tried:
+ * "<part>-<variant>" for one variant of a part and "<part>" for all, e.g.
+ * "52840-AAD0" and "52840". Sets dir to number i of BUNDLE_DIRS */
+static void bundle_dir(const nrf_dfu_response_hardware_t* hw, int i, char* dir)
+{
+	char variant[9];
+
+	if (i > 0) {
+		snprintf(dir, BUNDLE_DIR_LEN, "%X", hw->part);
+		return;
+	}
+
+	/* the variant is 4 ASCII characters like "AAD0" */
+	for (int c = 0; c < 4; c++) {
+		variant[c] = hw->variant >> (24 - 8 * c);
+		if (!isalnum((unsigned char)variant[c])) {
+			snprintf(variant, sizeof(variant), "%08X", hw->variant);
+			break;
 		}
+		variant[c + 1] = '\0';
 	}
+	snprintf(dir, BUNDLE_DIR_LEN, "%X-%s", hw->part, variant);
+}
 
-	ret = true;
+/* select the first package directory for the device in the bundle */
+static bool bundle_select(const char* file,
+						  const nrf_dfu_response_hardware_t* hw, char* dir)
+{
+	char path[BUNDLE_DIR_LEN + sizeof("/manifest.json")];
+	bool found = false;
 
-exit:
-	json_object_put(json);
-	// no need to json_object_put() the other jobs2/3
-	zip_fclose(zf);
-	return ret;
+	zip_t* zip = zip_open(file, ZIP_RDONLY, NULL);
+	if (zip == NULL) {
+		LOG_ERR("Could not open ZIP file '%s'", file);
+		return false;
+	}
+
+	for (int i = 0; i < BUNDLE_DIRS && !found; i++) {
+		bundle_dir(hw, i, dir);
+		snprintf(path, sizeof(path), "%s/manifest.json", dir);
+		found = zip_name_locate(zip, path, 0) >= 0;
+	}
+	zip_close(zip);
+
+	if (!found) {
+		bundle_dir(hw, 0, dir);
+		LOG_ERR("Bundle has no package for %s", dir);
+	}
+	return found;
 }
 
+/* only sets a flag, the update then fails and is cleaned up as usual.
+ * Logging or closing the port here could interrupt the same in main() */
 static void signal_handler(__attribute__((unused)) int signo)
 {
-	if (conf.dfu_type == DFU_SERIAL) {
-		ser_fini();
-	} else {
-		ble_fini();
+	if (conf.fleet) {
+		fleet_stop();
+	} else if (transport) {
+		transport->stop();
 	}
 }
 
 int main(int argc, char* argv[])
 {
 	int ret = EXIT_FAILURE;
-	char* ap_dat = NULL;
-	char* ap_bin = NULL;
-	char* sb_dat = NULL;
-	char* sb_bin = NULL;
-	zip_file_t* zf_ap_dat = NULL;
-	zip_file_t* zf_ap_bin = NULL;
-	zip_file_t* zf_sb_dat = NULL;
-	zip_file_t* zf_sb_bin = NULL;
-	size_t zs_ap_dat, zs_ap_bin, zs_sb_dat, zs_sb_bin;
-	enum dfu_ret r;
+	struct dfu_image img[MANIFEST_MAX_IMAGES] = {};
+	int num = 0;
+	bool cached = false;
+	bool entered = false;
+	bool reenter = false;
+	bool bundle = false;
+	char bundle_buf[BUNDLE_DIR_LEN];
+	const char* dir = NULL;
+
+	/* when the reader of the progress events goes away, writing them fails
+	 * with EPIPE instead of killing an update in the middle. Before the
+	 * options, which open the progress fd */
+	struct sigaction act;
+	act.sa_handler = SIG_IGN;
+	act.sa_flags = 0;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGPIPE, &act, NULL);
 
 	main_options(argc, argv);
 
 	/* register the signal SIGINT handler */
-	struct sigaction act;
 	act.sa_handler = signal_handler;
-	act.sa_flags = 0;
-	sigemptyset(&act.sa_mask);
 	sigaction(SIGINT, &act, NULL);
 
-	if (conf.dfu_type == DFU_SERIAL) {
-		LOG_INF("Serial Port: %s (%d baud)", conf.serport, conf.serspeed);
+	if (conf.fleet) {
+		LOG_INF("Fleet: %d serial ports (%d baud, DFU %d baud)", conf.nports,
+				conf.serspeed, conf.dfuspeed);
+	} else if (conf.dfu_type == DFU_SERIAL) {
+		LOG_INF("Serial Port: %s (%d baud, DFU %d baud)", conf.serport,
+				conf.serspeed, conf.dfuspeed);
 	} else {
 		if (conf.ble_addr == NULL) {
 			LOG_ERR("Need BLE Target addr -a");
@@ -325,127 +616,149 @@ int main(int argc, char* argv[])
 	}
 	LOG_INF("DFU Package: %s", conf.zipfile);
 
-	zip_t* zip = zip_open(conf.zipfile, ZIP_RDONLY, NULL);
-	if (zip == NULL) {
-		LOG_ERR("Could not open ZIP file '%s'", conf.zipfile);
-		goto exit;
+	if (conf.prom_file && !prom_init(conf.prom_file)) {
+		exit(EXIT_FAILURE);
+	}
+	if (conf.capture_file && !capture_open(conf.capture_file)) {
+		exit(EXIT_FAILURE);
 	}
 
-	if (!read_manifest(zip, &ap_dat, &ap_bin, &sb_dat, &sb_bin)) {
-		goto exit;
+	if (!conf.fleet) {
+		transport = conf.dfu_type == DFU_SERIAL ? &dfu_serial_transport
+												: &dfu_ble_transport;
+		dfu_set_transport(transport);
+		progress.port = conf.dfu_type == DFU_SERIAL ? conf.serport
+													: conf.ble_addr;
+		dfu_set_progress(&progress);
+		dfu_set_capture(capture_add_port(progress.port));
 	}
 
-	/* open all data files in ZIP file before starting */
-	if (sb_dat && sb_bin) {
-		zf_sb_dat = zip_file_open(zip, sb_dat, &zs_sb_dat);
-		zf_sb_bin = zip_file_open(zip, sb_bin, &zs_sb_bin);
-		if (zf_sb_dat == NULL || zf_sb_bin == NULL) {
-			LOG_ERR("Cannot open SD files in ZIP");
-			goto exit;
+	/* map the images from the cache when they are there, so the package is
+	 * not opened at all. The cache also knows if the package is a bundle */
+	if (conf.cache_dir && cache_open(conf.cache_dir, conf.zipfile)) {
+		bundle = cache_is_bundle();
+		if (!bundle) {
+			num = cache_load(img, ARRAY_SIZE(img));
+			cached = num > 0;
 		}
-		LOG_INF("Update contains Softdevice/Bootloader");
 	}
-	if (ap_dat && ap_bin) {
-		zf_ap_dat = zip_file_open(zip, ap_dat, &zs_ap_dat);
-		zf_ap_bin = zip_file_open(zip, ap_bin, &zs_ap_bin);
-		if (zf_ap_dat == NULL || zf_ap_bin == NULL) {
-			LOG_ERR("Cannot open APP files in ZIP");
+	if (!cached && !bundle) {
+		bundle = package_is_bundle(conf.zipfile);
+		if (bundle) {
+			cache_store_bundle();
+		}
+	}
+
+	/* the package of a bundle depends on the hardware version, which is
+	 * only known in the bootloader */
+	if (bundle) {
+		nrf_dfu_response_hardware_t hw;
+
+		if (conf.fleet) {
+			LOG_ERR("Bundles are not supported in fleet mode");
+			goto exit;
+		}
+		progress_phase(&progress, "enter", NULL, 0);
+		if (!dfu_bootloader_enter() || !dfu_hw_version(&hw)) {
 			goto exit;
 		}
-		LOG_INF("Update contains Application");
+		entered = true;
+
+		for (int i = 0; i < BUNDLE_DIRS && !cached; i++) {
+			bundle_dir(&hw, i, bundle_buf);
+			cache_variant(bundle_buf);
+			num = cache_load(img, ARRAY_SIZE(img));
+			cached = num > 0;
+		}
+		if (!cached) {
+			if (!bundle_select(conf.zipfile, &hw, bundle_buf)) {
+				goto exit;
+			}
+			cache_variant(bundle_buf);
+		}
+		LOG_NOTI("Using package %s/ of bundle", bundle_buf);
+		dir = bundle_buf;
 	}
 
-	if (sb_dat) {
-		LOG_NOTI("Updating SoftDevice/Bootloader (%zd bytes):", zs_sb_bin);
-	} else {
-		LOG_NOTI("Updating Application (%zd bytes):", zs_ap_bin);
+	/* decompress all images before starting */
+	if (!cached) {
+		num = package_load(conf.zipfile, dir, img);
+		if (num == 0) {
+			goto exit;
+		}
+		cache_store(img, num);
 	}
 
-	if (!dfu_bootloader_enter()) {
-		goto exit;
+	for (int i = 0; i < num; i++) {
+		LOG_INF("Update contains %s", img[i].name);
 	}
 
-	if (sb_dat) {
-		r = dfu_upgrade(zf_sb_dat, zs_sb_dat, zf_sb_bin, zs_sb_bin);
-		if (r == DFU_RET_ERROR) {
-			goto exit;
-		} else if (r == DFU_RET_FW_VERSION) {
-			/* Bootloader update may fail because it already has the same
-			 * version. In this case try updating the Application */
-			LOG_NOTI("SoftDevice/Bootloader not updated!");
-			if (ap_dat) {
-				LOG_NOTI("Updating Application (%zd bytes):", zs_ap_bin);
-				goto update_app;
-			}
+	if (conf.fleet) {
+		if (fleet_upgrade(img, num)) {
+			ret = EXIT_SUCCESS;
 		}
+		goto exit;
 	}
 
-	/* both updates BL+SD and APP are present, special handling of reconnection
-	 * to BL after update */
-	if (sb_dat && ap_dat) {
-		LOG_NOTI("Updating Application (%zd bytes):", zs_ap_bin);
-		if (conf.dfu_type == DFU_BLE) {
-			/* wait until bootloader disconnect while updating BL+SD */
-			ble_wait_disconnect(10000);
-			/* connect to BL again */
-			if (!ble_connect_dfu_targ(conf.interface, conf.ble_addr,
-									  conf.ble_atype)) {
-				/* if that fails, it may be that the APP is already running,
-				 * try to connect normally */
-				if (!dfu_bootloader_enter()) {
-					goto exit;
-				}
-			}
-		} else {
-			/* Serial: Reopen ACM device and sleep a bit and then try to ping */
-			if (conf.ser_acm) {
-				ser_reopen(10);
-			} else {
-				sleep(5);
-			}
-			bool p = false;
-			int cnt = 0;
-			while (!p && cnt < 3) {
-				p = dfu_ping();
-				cnt++;
+	/* images in manifest order, the device reconnects after each update */
+	for (int i = 0; i < num; i++) {
+		LOG_NOTI("Updating %s (%zd bytes):", img[i].name, img[i].bin_size);
+		if ((i == 0 && !entered) || reenter) {
+			progress_phase(&progress, "enter", img[i].name, 0);
+			if (i == 0 ? !dfu_bootloader_enter() : !transport->reenter()) {
+				goto exit;
 			}
 		}
-	}
 
-update_app:
-	if (ap_dat) {
-		r = dfu_upgrade(zf_ap_dat, zs_ap_dat, zf_ap_bin, zs_ap_bin);
-		if (r != DFU_RET_SUCCESS) {
+		enum dfu_ret r = dfu_upgrade(&img[i]);
+		if (r == DFU_RET_CURRENT) {
+			/* nothing was sent, the device is still in the bootloader */
+			LOG_NOTI("%s: %s is already current, skipped", progress.port,
+					 img[i].name);
+			reenter = false;
+		} else if (r == DFU_RET_FW_VERSION
+			&& strcmp(img[i].name, "Application") != 0) {
+			/* SoftDevice or Bootloader update may fail because it already
+			 * has the same version. In this case continue with the next
+			 * image, the device is still in the bootloader */
+			LOG_NOTI("%s: %s not updated!", progress.port, img[i].name);
+			reenter = false;
+		} else if (r != DFU_RET_SUCCESS) {
 			goto exit;
+		} else {
+			reenter = true;
 		}
 	}
 
+	/* the bootloader only starts the application again after an update */
+	if (!reenter) {
+		dfu_abort();
+	}
 	ret = EXIT_SUCCESS;
 
 exit:
-	free(ap_bin);
-	free(ap_dat);
-	free(sb_bin);
-	free(sb_dat);
-	if (zf_ap_dat) {
-		zip_fclose(zf_ap_dat);
+	if (!conf.fleet) {
+		progress_result(&progress, ret == EXIT_SUCCESS,
+						ret == EXIT_SUCCESS ? NULL : log_last_error());
+		metrics_count(ret == EXIT_SUCCESS ? MC_UPDATES_OK : MC_UPDATES_FAILED,
+					  1);
 	}
-	if (zf_ap_bin) {
-		zip_fclose(zf_ap_bin);
-	}
-	if (zf_sb_dat) {
-		zip_fclose(zf_sb_dat);
-	}
-	if (zf_sb_bin) {
-		zip_fclose(zf_sb_bin);
+	if (cached) {
+		cache_close();
+	} else {
+		images_free(img, num);
 	}
-	if (zip) {
-		zip_close(zip);
+	if (conf.fleet) {
+		free(conf.ports);
+	} else if (transport) {
+		transport->close();
 	}
-	if (conf.dfu_type == DFU_SERIAL) {
-		ser_fini();
-	} else {
-		ble_fini();
+	if (conf.metrics_file) {
+		metrics_write_json(conf.metrics_file);
 	}
+	prom_write(false);
+	prom_fini();
+	capture_close();
+	metrics_fini();
 	return ret;
 }
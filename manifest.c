@@ -0,0 +1,347 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+#include "manifest.h"
+
+/* lexer states */
+enum { MS_VALUE, MS_STRING, MS_ESCAPE, MS_UNICODE, MS_LITERAL, MS_ERROR };
+
+/* what is allowed next outside of strings and literals */
+enum { EX_VALUE, EX_KEY, EX_COLON, EX_NEXT, EX_END };
+
+/* keys in the manifest object, indexed by enum manifest_type */
+static const char* type_keys[MT_NONE] = {
+	"softdevice_bootloader",
+	"softdevice",
+	"bootloader",
+	"application",
+};
+
+static const char* type_names[MT_NONE + 1] = {
+	"SoftDevice/Bootloader", "SoftDevice", "Bootloader", "Application",
+	"Unknown",
+};
+
+const char* manifest_type_name(enum manifest_type type)
+{
+	return type_names[type < MT_NONE ? type : MT_NONE];
+}
+
+static enum manifest_type manifest_type(const char* key)
+{
+	for (int t = 0; t < MT_NONE; t++) {
+		if (strcmp(key, type_keys[t]) == 0) {
+			return t;
+		}
+	}
+	return MT_NONE;
+}
+
+static bool parse_error(struct manifest_parser* p, const char* msg)
+{
+	LOG_ERR("Manifest %s", msg);
+	p->state = MS_ERROR;
+	return false;
+}
+
+void manifest_init(struct manifest_parser* p)
+{
+	memset(p, 0, sizeof(*p));
+	p->state = MS_VALUE;
+	p->expect = EX_VALUE;
+}
+
+static void str_add(struct manifest_parser* p, unsigned int c)
+{
+	if (p->str_len + 1 < sizeof(p->str)) {
+		p->str[p->str_len++] = c;
+	} else {
+		p->str_long = true;
+	}
+}
+
+/* UTF-8 of a \u escape. Surrogate pairs are not combined, no file name
+ * nrfutil writes has them */
+static void str_add_code(struct manifest_parser* p, unsigned int c)
+{
+	if (c < 0x80) {
+		str_add(p, c);
+	} else if (c < 0x800) {
+		str_add(p, 0xC0 | c >> 6);
+		str_add(p, 0x80 | (c & 0x3F));
+	} else {
+		str_add(p, 0xE0 | c >> 12);
+		str_add(p, 0x80 | (c >> 6 & 0x3F));
+		str_add(p, 0x80 | (c & 0x3F));
+	}
+}
+
+/* a value is complete. Only strings at manifest.<type>.dat_file and
+ * manifest.<type>.bin_file are kept */
+static bool value_done(struct manifest_parser* p, bool is_string)
+{
+	if (p->depth == 3 && p->in_object[2]
+		&& strcmp(p->key[0], "manifest") == 0) {
+		enum manifest_type t = manifest_type(p->key[1]);
+		bool dat = strcmp(p->key[2], "dat_file") == 0;
+		bool bin = strcmp(p->key[2], "bin_file") == 0;
+
+		if (t != MT_NONE && (dat || bin)) {
+			if (!is_string || p->str_long || p->str_len == 0) {
+				return parse_error(p, "has an invalid file name");
+			}
+			struct manifest_image* img = &p->images[t];
+			img->type = t;
+			strcpy(dat ? img->dat_file : img->bin_file, p->str);
+			if (dat) {
+				p->has_dat[t] = true;
+			} else {
+				p->has_bin[t] = true;
+			}
+		}
+	}
+
+	p->expect = p->depth == 0 ? EX_END : EX_NEXT;
+	p->empty = false;
+	return true;
+}
+
+static bool string_done(struct manifest_parser* p)
+{
+	p->str[p->str_len] = '\0';
+	p->state = MS_VALUE;
+
+	if (!p->is_key) {
+		return value_done(p, true);
+	}
+
+	/* only the keys on the path to the image files are needed */
+	if (p->depth <= 3) {
+		strcpy(p->key[p->depth - 1], p->str_long ? "" : p->str);
+	}
+	p->expect = EX_COLON;
+	p->empty = false;
+	return true;
+}
+
+static bool container_open(struct manifest_parser* p, bool object)
+{
+	if (p->expect != EX_VALUE) {
+		return parse_error(p, "has an unexpected bracket");
+	}
+	if (p->depth == 0 && !object) {
+		return parse_error(p, "is not a JSON object");
+	}
+	if (p->depth >= MANIFEST_MAX_DEPTH) {
+		return parse_error(p, "is nested too deep");
+	}
+	p->in_object[p->depth++] = object;
+	if (p->depth <= 3) {
+		p->key[p->depth - 1][0] = '\0';
+	}
+	p->expect = object ? EX_KEY : EX_VALUE;
+	p->empty = true;
+	return true;
+}
+
+static bool container_close(struct manifest_parser* p, bool object)
+{
+	if (p->depth == 0 || p->in_object[p->depth - 1] != object
+		|| (p->expect != EX_NEXT && !p->empty)) {
+		return parse_error(p, "has an unexpected bracket");
+	}
+	p->depth--;
+	return value_done(p, false);
+}
+
+static bool is_literal(char c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '-'
+		   || c == '+' || c == '.' || c == 'E';
+}
+
+static bool manifest_char(struct manifest_parser* p, char c)
+{
+	switch (p->state) {
+	case MS_STRING:
+		if (c == '"') {
+			return string_done(p);
+		} else if (c == '\\') {
+			p->state = MS_ESCAPE;
+		} else if ((unsigned char)c < 0x20) {
+			return parse_error(p, "has a control character in a string");
+		} else {
+			str_add(p, c);
+		}
+		return true;
+
+	case MS_ESCAPE:
+		p->state = MS_STRING;
+		switch (c) {
+		case 'b':
+			str_add(p, '\b');
+			break;
+		case 'f':
+			str_add(p, '\f');
+			break;
+		case 'n':
+			str_add(p, '\n');
+			break;
+		case 'r':
+			str_add(p, '\r');
+			break;
+		case 't':
+			str_add(p, '\t');
+			break;
+		case '"':
+		case '\\':
+		case '/':
+			str_add(p, c);
+			break;
+		case 'u':
+			p->state = MS_UNICODE;
+			p->ucode = 0;
+			p->uhex = 0;
+			break;
+		default:
+			return parse_error(p, "has an invalid escape");
+		}
+		return true;
+
+	case MS_UNICODE:
+		p->ucode <<= 4;
+		if (c >= '0' && c <= '9') {
+			p->ucode |= c - '0';
+		} else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+			p->ucode |= (c | 0x20) - 'a' + 10;
+		} else {
+			return parse_error(p, "has an invalid escape");
+		}
+		if (++p->uhex == 4) {
+			str_add_code(p, p->ucode);
+			p->state = MS_STRING;
+		}
+		return true;
+
+	case MS_LITERAL:
+		if (is_literal(c)) {
+			return true;
+		}
+		/* numbers, true, false and null are not needed */
+		p->state = MS_VALUE;
+		if (!value_done(p, false)) {
+			return false;
+		}
+		return manifest_char(p, c);
+
+	case MS_VALUE:
+		break;
+
+	default:
+		return false;
+	}
+
+	if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+		return true;
+	}
+	if (p->expect == EX_END) {
+		return parse_error(p, "has data after the end");
+	}
+
+	switch (c) {
+	case '{':
+		return container_open(p, true);
+	case '[':
+		return container_open(p, false);
+	case '}':
+		return container_close(p, true);
+	case ']':
+		return container_close(p, false);
+	case ':':
+		if (p->expect != EX_COLON) {
+			return parse_error(p, "has an unexpected ':'");
+		}
+		p->expect = EX_VALUE;
+		return true;
+	case ',':
+		if (p->expect != EX_NEXT) {
+			return parse_error(p, "has an unexpected ','");
+		}
+		p->expect = p->in_object[p->depth - 1] ? EX_KEY : EX_VALUE;
+		return true;
+	case '"':
+		if (p->expect != EX_KEY && p->expect != EX_VALUE) {
+			return parse_error(p, "has an unexpected string");
+		}
+		p->is_key = p->expect == EX_KEY;
+		p->str_len = 0;
+		p->str_long = false;
+		p->state = MS_STRING;
+		return true;
+	default:
+		if (p->expect != EX_VALUE || p->depth == 0 || !is_literal(c)) {
+			return parse_error(p, "is not valid JSON");
+		}
+		p->state = MS_LITERAL;
+		return true;
+	}
+}
+
+bool manifest_feed(struct manifest_parser* p, const char* buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		if (!manifest_char(p, buf[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool manifest_finish(struct manifest_parser* p, struct manifest* m)
+{
+	if (p->state == MS_ERROR) {
+		return false;
+	}
+	if (p->state != MS_VALUE || p->expect != EX_END) {
+		return parse_error(p, "is truncated");
+	}
+
+	m->num = 0;
+	for (int t = 0; t < MT_NONE; t++) {
+		if (!p->has_dat[t] && !p->has_bin[t]) {
+			continue;
+		}
+		if (!p->has_dat[t] || !p->has_bin[t]) {
+			LOG_ERR("Manifest missing %s files", type_names[t]);
+			return false;
+		}
+		m->images[m->num++] = p->images[t];
+	}
+
+	if (m->num == 0) {
+		LOG_ERR("Manifest contains no image");
+		return false;
+	}
+	return true;
+}
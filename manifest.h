@@ -0,0 +1,84 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MANIFEST_NAME_LEN	 128
+#define MANIFEST_MAX_DEPTH	 16
+#define MANIFEST_MAX_IMAGES	 4
+
+/* image types of nrfutil packages, in the order they are updated */
+enum manifest_type {
+	MT_SOFTDEVICE_BOOTLOADER,
+	MT_SOFTDEVICE,
+	MT_BOOTLOADER,
+	MT_APPLICATION,
+	MT_NONE,
+};
+
+struct manifest_image {
+	enum manifest_type type;
+	char dat_file[MANIFEST_NAME_LEN];
+	char bin_file[MANIFEST_NAME_LEN];
+	/* uncompressed sizes of the files, the manifest doesn't have them so
+	 * they are filled in from the package after manifest_finish() */
+	size_t dat_size;
+	size_t bin_size;
+};
+
+struct manifest {
+	struct manifest_image images[MANIFEST_MAX_IMAGES];
+	int num;
+};
+
+/* Streaming parser of manifest.json. It keeps only the keys on the path to
+ * the current value, so it needs no allocations and handles any size */
+struct manifest_parser {
+	int state;
+	int expect;
+	bool empty;
+	int depth;
+	bool in_object[MANIFEST_MAX_DEPTH];
+	/* keys of the first levels: "manifest", image type, file */
+	char key[3][MANIFEST_NAME_LEN];
+	bool is_key;
+	char str[MANIFEST_NAME_LEN];
+	size_t str_len;
+	bool str_long;
+	unsigned int ucode;
+	int uhex;
+	bool has_dat[MT_NONE];
+	bool has_bin[MT_NONE];
+	struct manifest_image images[MT_NONE];
+};
+
+void manifest_init(struct manifest_parser* p);
+/* parse the next len bytes of the manifest */
+bool manifest_feed(struct manifest_parser* p, const char* buf, size_t len);
+/* check the manifest is complete and return its images in update order */
+bool manifest_finish(struct manifest_parser* p, struct manifest* m);
+const char* manifest_type_name(enum manifest_type type);
+
+#endif
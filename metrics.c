@@ -0,0 +1,265 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "util.h"
+
+/* opcodes up to NRF_DFU_OP_ABORT */
+#define METRICS_OPS (NRF_DFU_OP_ABORT + 1)
+
+struct metrics_object {
+	uint8_t type;
+	uint32_t offset;
+	uint32_t size;
+	uint64_t us;
+};
+
+const uint32_t metrics_bucket_us[METRICS_BUCKETS] = {
+	100,	250,	500,	1000,	 2500,	  5000,	   10000,	25000,
+	50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+const uint32_t metrics_phase_bucket_us[METRICS_PHASE_BUCKETS] = {
+	100000,	  250000,	500000,	   1000000,	  2500000,	 5000000,
+	10000000, 25000000, 50000000, 100000000, 250000000, 500000000,
+};
+
+static const char* op_names[METRICS_OPS] = {
+	[NRF_DFU_OP_PROTOCOL_VERSION] = "protocol_version",
+	[NRF_DFU_OP_OBJECT_CREATE] = "create",
+	[NRF_DFU_OP_RECEIPT_NOTIF_SET] = "prn_set",
+	[NRF_DFU_OP_CRC_GET] = "crc_get",
+	[NRF_DFU_OP_OBJECT_EXECUTE] = "execute",
+	[NRF_DFU_OP_OBJECT_SELECT] = "select",
+	[NRF_DFU_OP_MTU_GET] = "mtu_get",
+	[NRF_DFU_OP_OBJECT_WRITE] = "write",
+	[NRF_DFU_OP_PING] = "ping",
+	[NRF_DFU_OP_HARDWARE_VERSION] = "hardware_version",
+	[NRF_DFU_OP_FIRMWARE_VERSION] = "firmware_version",
+	[NRF_DFU_OP_ABORT] = "abort",
+};
+
+static const char* counter_names[MC_MAX] = {
+	[MC_BYTES] = "bytes",
+	[MC_OBJECTS] = "objects",
+	[MC_OBJECT_RETRIES] = "object_retries",
+	[MC_CRC_ERRORS] = "crc_errors",
+	[MC_PRN_ERRORS] = "prn_errors",
+	[MC_TIMEOUTS] = "timeouts",
+	[MC_SLIP_ERRORS] = "slip_errors",
+	[MC_RESUME_SKIPPED] = "resume_skipped_bytes",
+	[MC_IMAGES_CURRENT] = "images_current",
+	[MC_UPDATES_OK] = "updates_ok",
+	[MC_UPDATES_FAILED] = "updates_failed",
+};
+
+static const char* phase_names[MP_MAX] = {
+	[MP_ENTER] = "enter",
+	[MP_INIT] = "init",
+	[MP_DATA] = "data",
+};
+
+static struct metrics_hist hist[METRICS_OPS];
+static struct metrics_hist phase_hist[MP_MAX];
+static uint64_t counters[MC_MAX];
+static struct metrics_object* objects;
+static size_t num_objects;
+static size_t max_objects;
+
+static void hist_add(struct metrics_hist* h, const uint32_t* bounds,
+					 int nbuckets, uint64_t us)
+{
+	int b = 0;
+	while (b < nbuckets && us > bounds[b]) {
+		b++;
+	}
+	h->bucket[b]++;
+	h->count++;
+	h->sum_us += us;
+	h->max_us = MAX(h->max_us, us);
+}
+
+void metrics_latency(nrf_dfu_op_t op, uint64_t us)
+{
+	if (op < METRICS_OPS) {
+		hist_add(&hist[op], metrics_bucket_us, METRICS_BUCKETS, us);
+	}
+}
+
+void metrics_phase(const char* phase, uint64_t us)
+{
+	for (int ph = 0; ph < MP_MAX; ph++) {
+		if (strcmp(phase, phase_names[ph]) == 0) {
+			hist_add(&phase_hist[ph], metrics_phase_bucket_us,
+					 METRICS_PHASE_BUCKETS, us);
+			return;
+		}
+	}
+}
+
+void metrics_count(enum metrics_counter c, uint64_t n)
+{
+	counters[c] += n;
+}
+
+void metrics_object(uint8_t type, uint32_t offset, uint32_t size,
+					uint64_t us)
+{
+	counters[MC_OBJECTS]++;
+
+	if (num_objects == max_objects) {
+		size_t max = max_objects ? 2 * max_objects : 64;
+		struct metrics_object* o = realloc(objects, max * sizeof(*o));
+		if (o == NULL) {
+			return;
+		}
+		objects = o;
+		max_objects = max;
+	}
+
+	objects[num_objects++] = (struct metrics_object){
+		.type = type,
+		.offset = offset,
+		.size = size,
+		.us = us,
+	};
+}
+
+const struct metrics_hist* metrics_op_hist(nrf_dfu_op_t op)
+{
+	return op < METRICS_OPS ? &hist[op] : NULL;
+}
+
+const struct metrics_hist* metrics_phase_hist(enum metrics_phase ph)
+{
+	return &phase_hist[ph];
+}
+
+uint64_t metrics_counter(enum metrics_counter c)
+{
+	return counters[c];
+}
+
+const char* metrics_op_name(nrf_dfu_op_t op)
+{
+	return op < METRICS_OPS ? op_names[op] : NULL;
+}
+
+const char* metrics_counter_name(enum metrics_counter c)
+{
+	return counter_names[c];
+}
+
+const char* metrics_phase_name(enum metrics_phase ph)
+{
+	return phase_names[ph];
+}
+
+static void json_hist(FILE* f, const struct metrics_hist* h,
+					  const uint32_t* bounds, int nbuckets)
+{
+	uint32_t cum = 0;
+
+	fprintf(f, "{\"count\": %u, \"sum_us\": %llu, \"max_us\": %llu, ",
+			h->count, (unsigned long long)h->sum_us,
+			(unsigned long long)h->max_us);
+	/* cumulative like Prometheus: requests which took at most le_us */
+	fprintf(f, "\"buckets\": [");
+	for (int b = 0; b <= nbuckets; b++) {
+		cum += h->bucket[b];
+		if (b < nbuckets) {
+			fprintf(f, "{\"le_us\": %u, \"count\": %u}, ", bounds[b], cum);
+		} else {
+			fprintf(f, "{\"le_us\": null, \"count\": %u}", cum);
+		}
+	}
+	fprintf(f, "]}");
+}
+
+bool metrics_write_json(const char* file)
+{
+	FILE* f = fopen(file, "w");
+	if (f == NULL) {
+		LOG_ERR("Could not write metrics to '%s': %s", file, strerror(errno));
+		return false;
+	}
+
+	fprintf(f, "{\n  \"requests\": {");
+	const char* sep = "";
+	for (int op = 0; op < METRICS_OPS; op++) {
+		if (hist[op].count == 0) {
+			continue;
+		}
+		fprintf(f, "%s\n    \"%s\": ", sep, op_names[op]);
+		json_hist(f, &hist[op], metrics_bucket_us, METRICS_BUCKETS);
+		sep = ",";
+	}
+
+	fprintf(f, "\n  },\n  \"phases\": {");
+	sep = "";
+	for (int ph = 0; ph < MP_MAX; ph++) {
+		if (phase_hist[ph].count == 0) {
+			continue;
+		}
+		fprintf(f, "%s\n    \"%s\": ", sep, phase_names[ph]);
+		json_hist(f, &phase_hist[ph], metrics_phase_bucket_us,
+				  METRICS_PHASE_BUCKETS);
+		sep = ",";
+	}
+
+	fprintf(f, "\n  },\n  \"counters\": {");
+	for (int c = 0; c < MC_MAX; c++) {
+		fprintf(f, "%s\n    \"%s\": %llu", c ? "," : "", counter_names[c],
+				(unsigned long long)counters[c]);
+	}
+
+	fprintf(f, "\n  },\n  \"objects\": [");
+	for (size_t i = 0; i < num_objects; i++) {
+		const struct metrics_object* o = &objects[i];
+		fprintf(f,
+				"%s\n    {\"type\": %u, \"offset\": %u, \"size\": %u, "
+				"\"us\": %llu, \"bytes_per_s\": %llu}",
+				i ? "," : "", o->type, o->offset, o->size,
+				(unsigned long long)o->us,
+				(unsigned long long)(o->us ? o->size * 1000000ULL / o->us
+										   : 0));
+	}
+	fprintf(f, "\n  ]\n}\n");
+
+	bool ok = !ferror(f);
+	if (fclose(f) != 0 || !ok) {
+		LOG_ERR("Could not write metrics to '%s'", file);
+		return false;
+	}
+	return true;
+}
+
+void metrics_fini(void)
+{
+	free(objects);
+	objects = NULL;
+	num_objects = max_objects = 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nrf_dfu_req_handler.h"
+
+/* histogram buckets, upper bounds in us. The last bucket counts everything
+ * above */
+#define METRICS_BUCKETS		  16
+#define METRICS_PHASE_BUCKETS 12
+
+enum metrics_counter {
+	MC_BYTES,		   /* object data sent */
+	MC_OBJECTS,		   /* objects written */
+	MC_OBJECT_RETRIES, /* objects sent again */
+	MC_CRC_ERRORS,
+	MC_PRN_ERRORS,
+	MC_TIMEOUTS, /* requests without response */
+	MC_SLIP_ERRORS,
+	MC_RESUME_SKIPPED, /* bytes the device already had */
+	MC_IMAGES_CURRENT, /* images the device already had */
+	MC_UPDATES_OK,
+	MC_UPDATES_FAILED,
+	MC_MAX,
+};
+
+/* phases of the update of one image, see progress_phase() */
+enum metrics_phase {
+	MP_ENTER,
+	MP_INIT,
+	MP_DATA,
+	MP_MAX,
+};
+
+struct metrics_hist {
+	uint32_t count;
+	uint64_t sum_us;
+	uint64_t max_us;
+	uint32_t bucket[METRICS_BUCKETS + 1];
+};
+
+extern const uint32_t metrics_bucket_us[METRICS_BUCKETS];
+extern const uint32_t metrics_phase_bucket_us[METRICS_PHASE_BUCKETS];
+
+/* time from sending a request to its response */
+void metrics_latency(nrf_dfu_op_t op, uint64_t us);
+void metrics_count(enum metrics_counter c, uint64_t n);
+/* duration of a phase by name, others are ignored */
+void metrics_phase(const char* phase, uint64_t us);
+/* time to send the data of one object */
+void metrics_object(uint8_t type, uint32_t offset, uint32_t size,
+					uint64_t us);
+const struct metrics_hist* metrics_op_hist(nrf_dfu_op_t op);
+const struct metrics_hist* metrics_phase_hist(enum metrics_phase ph);
+uint64_t metrics_counter(enum metrics_counter c);
+const char* metrics_op_name(nrf_dfu_op_t op);
+const char* metrics_counter_name(enum metrics_counter c);
+const char* metrics_phase_name(enum metrics_phase ph);
+bool metrics_write_json(const char* file);
+void metrics_fini(void);
+
+#endif
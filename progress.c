@@ -0,0 +1,229 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "progress.h"
+#include "util.h"
+
+/* longest port and image name in an event, so that the line stays valid JSON
+ * with the error of the result event */
+#define NAME_MAX_JSON 160
+
+static int progress_fd = -1;
+static uint64_t progress_start;
+
+bool progress_init(const char* spec)
+{
+	if (strcmp(spec, "jsonl") == 0) {
+		/* the events get stdout, everything else goes to stderr */
+		log_flush();
+		fflush(stdout);
+		progress_fd = dup(STDOUT_FILENO);
+		if (progress_fd >= 0) {
+			dup2(STDERR_FILENO, STDOUT_FILENO);
+		}
+	} else if (strncmp(spec, "jsonl:", 6) == 0) {
+		char* end;
+		progress_fd = strtol(spec + 6, &end, 10);
+		if (end == spec + 6 || *end != '\0') {
+			progress_fd = -1;
+		}
+	} else {
+		LOG_ERR("Unknown progress format '%s'", spec);
+		return false;
+	}
+
+	if (progress_fd < 0) {
+		LOG_ERR("Invalid progress output '%s'", spec);
+		return false;
+	}
+	progress_start = time_ms();
+	return true;
+}
+
+bool progress_enabled(void)
+{
+	return progress_fd >= 0;
+}
+
+/* append to the line in buf of size, *n is its length and stays below size
+ * when the output is truncated */
+static void line_vprintf(char* buf, size_t size, size_t* n, const char* fmt,
+						 va_list args)
+{
+	int ret = vsnprintf(buf + *n, size - *n, fmt, args);
+	if (ret > 0) {
+		*n = MIN(*n + ret, size - 1);
+	}
+}
+
+static void __attribute__((format(printf, 4, 5)))
+line_printf(char* buf, size_t size, size_t* n, const char* fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	line_vprintf(buf, size, n, fmt, args);
+	va_end(args);
+}
+
+/* append s as JSON string, shortened to fit but always closed */
+static void json_str(char* buf, size_t size, size_t* n, const char* s)
+{
+	if (s == NULL) {
+		line_printf(buf, size, n, "null");
+		return;
+	}
+
+	/* both quotes and the NUL */
+	if (*n + 3 > size) {
+		return;
+	}
+	buf[(*n)++] = '"';
+	for (; *s; s++) {
+		bool esc = *s == '"' || *s == '\\';
+		if ((unsigned char)*s < ' ') {
+			continue;
+		}
+		if (*n + esc + 3 > size) {
+			break;
+		}
+		if (esc) {
+			buf[(*n)++] = '\\';
+		}
+		buf[(*n)++] = *s;
+	}
+	buf[(*n)++] = '"';
+	buf[*n] = '\0';
+}
+
+/* one line with the common fields and fmt appended, written at once so
+ * events of several ports don't mix */
+static void __attribute__((format(printf, 3, 4)))
+progress_event(struct progress* p, const char* event, const char* fmt, ...)
+{
+	char buf[1024];
+	/* the end is kept free for "}\n" */
+	size_t size = sizeof(buf) - 2;
+	size_t n = 0;
+	va_list args;
+
+	line_printf(buf, size, &n, "{\"time_ms\": %llu, \"event\": \"%s\", ",
+				(unsigned long long)(time_ms() - progress_start), event);
+	line_printf(buf, size, &n, "\"port\": ");
+	json_str(buf, MIN(size, n + NAME_MAX_JSON), &n, p->port);
+	line_printf(buf, size, &n, ", \"image\": ");
+	json_str(buf, MIN(size, n + NAME_MAX_JSON), &n, p->image);
+
+	va_start(args, fmt);
+	line_vprintf(buf, size, &n, fmt, args);
+	va_end(args);
+	buf[n++] = '}';
+	buf[n++] = '\n';
+
+	/* stop when the consumer is gone */
+	if (write(progress_fd, buf, n) < 0) {
+		progress_fd = -1;
+	}
+}
+
+static void progress_phase_end(struct progress* p)
+{
+	if (p->phase) {
+		metrics_phase(p->phase, (time_ms() - p->start) * 1000);
+		p->phase = NULL;
+	}
+}
+
+void progress_phase(struct progress* p, const char* phase, const char* image,
+					size_t total)
+{
+	progress_phase_end(p);
+	if (image) {
+		p->image = image;
+	}
+	p->phase = phase;
+	p->total = total;
+	p->start = time_ms();
+	p->last = 0;
+	p->last_done = 0;
+
+	if (progress_fd < 0) {
+		return;
+	}
+	progress_event(p, "phase", ", \"phase\": \"%s\", \"total\": %zu", phase,
+				   total);
+}
+
+void progress_update(struct progress* p, uint32_t object, uint32_t offset,
+					 size_t done, bool force)
+{
+	if (progress_fd < 0) {
+		return;
+	}
+
+	uint64_t now = time_ms();
+	uint64_t since = p->last ? p->last : p->start;
+	if (!force && now - since < PROGRESS_INTERVAL) {
+		return;
+	}
+
+	/* bytes/s since the last event and since the start of the phase */
+	uint64_t rate = 0;
+	/* done goes back when an object is sent again */
+	if (now > since && done >= p->last_done) {
+		rate = (done - p->last_done) * 1000 / (now - since);
+	}
+	uint64_t avg = now > p->start ? done * 1000 / (now - p->start) : 0;
+	double eta = avg > 0 && p->total > done
+					 ? (double)(p->total - done) / avg
+					 : 0;
+
+	progress_event(p, "progress",
+				   ", \"object\": %u, \"offset\": %u, \"bytes\": %zu, "
+				   "\"total\": %zu, \"rate\": %llu, \"avg_rate\": %llu, "
+				   "\"eta_s\": %.1f",
+				   object, offset, done, p->total, (unsigned long long)rate,
+				   (unsigned long long)avg, eta);
+	p->last = now;
+	p->last_done = done;
+}
+
+void progress_result(struct progress* p, bool ok, const char* error)
+{
+	char err[300];
+	size_t n = 0;
+
+	progress_phase_end(p);
+	if (progress_fd < 0) {
+		return;
+	}
+
+	json_str(err, sizeof(err), &n, error);
+	progress_event(p, "result", ", \"ok\": %s, \"error\": %s",
+				   ok ? "true" : "false", err);
+}
@@ -0,0 +1,52 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* at most one progress event per port in this time */
+#define PROGRESS_INTERVAL 250
+
+/* progress of the update of one device, for --progress=jsonl. The phase
+ * durations also go to the metrics */
+struct progress {
+	const char* port;
+	const char* image;
+	const char* phase;
+	size_t total; /* of the current phase */
+	uint64_t start;
+	uint64_t last; /* time of the last event, 0 for none */
+	size_t last_done;
+};
+
+/* spec is "jsonl" for stdout or "jsonl:<fd>" */
+bool progress_init(const char* spec);
+bool progress_enabled(void);
+void progress_phase(struct progress* p, const char* phase, const char* image,
+					size_t total);
+void progress_update(struct progress* p, uint32_t object, uint32_t offset,
+					 size_t done, bool force);
+void progress_result(struct progress* p, bool ok, const char* error);
+
+#endif
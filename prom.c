@@ -0,0 +1,283 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "prom.h"
+#include "util.h"
+
+#define PROM_MAX_SERIES 512
+#define PROM_KEY_LEN	160
+
+/* the opcodes which get a latency histogram. Always all of them, so every
+ * series of the last file is written again */
+static const nrf_dfu_op_t prom_ops[] = {
+	NRF_DFU_OP_OBJECT_CREATE, NRF_DFU_OP_RECEIPT_NOTIF_SET,
+	NRF_DFU_OP_CRC_GET,		  NRF_DFU_OP_OBJECT_EXECUTE,
+	NRF_DFU_OP_OBJECT_SELECT, NRF_DFU_OP_MTU_GET,
+	NRF_DFU_OP_PING,
+};
+
+/* a counter value by its key with labels */
+struct prom_series {
+	char key[PROM_KEY_LEN];
+	double value;
+	double next;
+};
+
+static const char* prom_file;
+/* counter values in the file, read again before every write, so that
+ * several processes can add to the same file */
+static struct prom_series* base;
+static int nbase;
+/* values of this process already added to the file (value) and added by the
+ * write in progress (next) */
+static struct prom_series* sent;
+static int nsent;
+static uint64_t last_write;
+
+static void prom_load(void)
+{
+	char line[PROM_KEY_LEN + 40];
+
+	nbase = 0;
+	FILE* f = fopen(prom_file, "r");
+	if (f == NULL) {
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f) && nbase < PROM_MAX_SERIES) {
+		char* sp = strrchr(line, ' ');
+		if (line[0] == '#' || sp == NULL || sp - line >= PROM_KEY_LEN) {
+			continue;
+		}
+		*sp = '\0';
+		/* only counters and histograms, not gauges */
+		if (strstr(line, "_total") == NULL && strstr(line, "_bucket") == NULL
+			&& strstr(line, "_sum") == NULL && strstr(line, "_count") == NULL) {
+			continue;
+		}
+		strcpy(base[nbase].key, line);
+		base[nbase].value = strtod(sp + 1, NULL);
+		nbase++;
+	}
+	fclose(f);
+}
+
+bool prom_init(const char* file)
+{
+	prom_file = file;
+	base = calloc(PROM_MAX_SERIES, sizeof(*base));
+	sent = calloc(PROM_MAX_SERIES, sizeof(*sent));
+	if (base == NULL || sent == NULL) {
+		LOG_ERR("Out of memory");
+		free(base);
+		free(sent);
+		base = sent = NULL;
+		return false;
+	}
+	last_write = time_ms();
+	return true;
+}
+
+static double prom_base(const char* key)
+{
+	for (int i = 0; i < nbase; i++) {
+		if (strcmp(base[i].key, key) == 0) {
+			return base[i].value;
+		}
+	}
+	return 0;
+}
+
+static struct prom_series* prom_sent(const char* key)
+{
+	for (int i = 0; i < nsent; i++) {
+		if (strcmp(sent[i].key, key) == 0) {
+			return &sent[i];
+		}
+	}
+	if (nsent == PROM_MAX_SERIES) {
+		return NULL;
+	}
+	snprintf(sent[nsent].key, PROM_KEY_LEN, "%s", key);
+	return &sent[nsent++];
+}
+
+/* the value in the file plus what this process counted since its last write */
+static void prom_counter(FILE* f, const char* key, double value)
+{
+	struct prom_series* s = prom_sent(key);
+	double add = value;
+
+	if (s) {
+		add -= s->value;
+		s->next = value;
+	}
+	fprintf(f, "%s %.15g\n", key, prom_base(key) + add);
+}
+
+static void prom_hist(FILE* f, const char* name, const char* label,
+					  const char* lvalue, const struct metrics_hist* h,
+					  const uint32_t* bounds, int nbuckets)
+{
+	char key[PROM_KEY_LEN];
+	uint32_t cum = 0;
+
+	for (int b = 0; b <= nbuckets; b++) {
+		cum += h->bucket[b];
+		if (b < nbuckets) {
+			snprintf(key, sizeof(key), "%s_bucket{%s=\"%s\",le=\"%g\"}", name,
+					 label, lvalue, bounds[b] / 1e6);
+		} else {
+			snprintf(key, sizeof(key), "%s_bucket{%s=\"%s\",le=\"+Inf\"}",
+					 name, label, lvalue);
+		}
+		prom_counter(f, key, cum);
+	}
+	snprintf(key, sizeof(key), "%s_sum{%s=\"%s\"}", name, label, lvalue);
+	prom_counter(f, key, h->sum_us / 1e6);
+	snprintf(key, sizeof(key), "%s_count{%s=\"%s\"}", name, label, lvalue);
+	prom_counter(f, key, h->count);
+}
+
+static void prom_write_metrics(FILE* f, bool running)
+{
+	char key[PROM_KEY_LEN];
+
+	fprintf(f, "# HELP nrfdfu_updates_total Device updates by result.\n"
+			   "# TYPE nrfdfu_updates_total counter\n");
+	prom_counter(f, "nrfdfu_updates_total{result=\"success\"}",
+				 metrics_counter(MC_UPDATES_OK));
+	prom_counter(f, "nrfdfu_updates_total{result=\"failure\"}",
+				 metrics_counter(MC_UPDATES_FAILED));
+
+	for (int c = 0; c < MC_MAX; c++) {
+		if (c == MC_UPDATES_OK || c == MC_UPDATES_FAILED) {
+			continue;
+		}
+		snprintf(key, sizeof(key), "nrfdfu_%s_total", metrics_counter_name(c));
+		fprintf(f, "# TYPE %s counter\n", key);
+		prom_counter(f, key, metrics_counter(c));
+	}
+
+	fprintf(f, "# HELP nrfdfu_request_duration_seconds Time from a request "
+			   "to its response.\n"
+			   "# TYPE nrfdfu_request_duration_seconds histogram\n");
+	for (size_t i = 0; i < ARRAY_SIZE(prom_ops); i++) {
+		prom_hist(f, "nrfdfu_request_duration_seconds", "op",
+				  metrics_op_name(prom_ops[i]), metrics_op_hist(prom_ops[i]),
+				  metrics_bucket_us, METRICS_BUCKETS);
+	}
+
+	fprintf(f, "# HELP nrfdfu_phase_duration_seconds Duration of the update "
+			   "phases of an image.\n"
+			   "# TYPE nrfdfu_phase_duration_seconds histogram\n");
+	for (int ph = 0; ph < MP_MAX; ph++) {
+		prom_hist(f, "nrfdfu_phase_duration_seconds", "phase",
+				  metrics_phase_name(ph), metrics_phase_hist(ph),
+				  metrics_phase_bucket_us, METRICS_PHASE_BUCKETS);
+	}
+
+	fprintf(f, "# HELP nrfdfu_running 1 while an update is running.\n"
+			   "# TYPE nrfdfu_running gauge\n"
+			   "nrfdfu_running %d\n",
+			running);
+	fprintf(f, "# TYPE nrfdfu_last_write_timestamp_seconds gauge\n"
+			   "nrfdfu_last_write_timestamp_seconds %lld\n",
+			(long long)time(NULL));
+}
+
+/* the collector may read at any time, so write a new file and rename it.
+ * Other processes writing the same file wait on the lock file, so that none
+ * of their counts are lost between reading and renaming */
+bool prom_write(bool running)
+{
+	char tmp[PATH_MAX];
+	char lock[PATH_MAX];
+	bool ok = false;
+
+	if (prom_file == NULL) {
+		return true;
+	}
+
+	last_write = time_ms();
+	snprintf(lock, sizeof(lock), "%s.lock", prom_file);
+	int lfd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lfd < 0 || flock(lfd, LOCK_EX) < 0) {
+		LOG_ERR("Could not lock '%s': %s", lock, strerror(errno));
+		goto out;
+	}
+
+	prom_load();
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", prom_file, getpid());
+	FILE* f = fopen(tmp, "w");
+	if (f == NULL) {
+		LOG_ERR("Could not write '%s': %s", tmp, strerror(errno));
+		goto out;
+	}
+
+	prom_write_metrics(f, running);
+
+	ok = !ferror(f);
+	if (fclose(f) != 0 || !ok || rename(tmp, prom_file) != 0) {
+		LOG_ERR("Could not write '%s': %s", prom_file, strerror(errno));
+		unlink(tmp);
+		ok = false;
+		goto out;
+	}
+
+	/* the counts are in the file now */
+	for (int i = 0; i < nsent; i++) {
+		sent[i].value = sent[i].next;
+	}
+
+out:
+	if (lfd >= 0) {
+		close(lfd);
+	}
+	return ok;
+}
+
+void prom_tick(void)
+{
+	if (prom_file && time_ms() - last_write >= PROM_INTERVAL * 1000) {
+		prom_write(true);
+	}
+}
+
+void prom_fini(void)
+{
+	free(base);
+	free(sent);
+	base = sent = NULL;
+	nbase = nsent = 0;
+	prom_file = NULL;
+}
@@ -0,0 +1,37 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PROM_H
+#define PROM_H
+
+#include <stdbool.h>
+
+/* seconds between writes during a run */
+#define PROM_INTERVAL 10
+
+/* Prometheus textfile collector output of the metrics. Counters continue
+ * from the values in file, so they keep counting over runs */
+bool prom_init(const char* file);
+/* write when PROM_INTERVAL has passed since the last write */
+void prom_tick(void);
+bool prom_write(bool running);
+void prom_fini(void);
+
+#endif
@@ -20,45 +20,61 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
 #include "log.h"
 #include "serialtty.h"
+#include "util.h"
 
 #define MAX_CONF_LEN 200
 
-static struct termios tty;
-static struct termios otty;
+/* check for a recreated device node at least this often (ms) */
+#define REOPEN_POLL_INTERVAL 100
 
-static void serial_set_tty_speed(int baud)
+/* returns false if the baudrate has no Bxxx constant and has to be set
+ * with serial_set_custom_baudrate() after tcsetattr() */
+static bool serial_set_tty_speed(struct termios* tty, int baud)
 {
 	// clang-format off
 	switch (baud) {
-		case 57600:		tty.c_cflag |= B57600; break;
-		case 115200:	tty.c_cflag |= B115200; break;
-		case 230400:	tty.c_cflag |= B230400; break;
+		case 57600:		tty->c_cflag |= B57600; break;
+		case 115200:	tty->c_cflag |= B115200; break;
+		case 230400:	tty->c_cflag |= B230400; break;
 #ifndef __APPLE__
-		case 460800:	tty.c_cflag |= B460800; break;
-		case 500000:	tty.c_cflag |= B500000; break;
-		case 576000:	tty.c_cflag |= B576000; break;
-		case 921600:	tty.c_cflag |= B921600; break;
-		case 1000000:	tty.c_cflag |= B1000000; break;
+		case 460800:	tty->c_cflag |= B460800; break;
+		case 500000:	tty->c_cflag |= B500000; break;
+		case 576000:	tty->c_cflag |= B576000; break;
+		case 921600:	tty->c_cflag |= B921600; break;
+		case 1000000:	tty->c_cflag |= B1000000; break;
 #endif
-		default:		LOG_ERR("Unknown baudrate %d", baud);
+		/* placeholder, B0 would hang up */
+		default:		tty->c_cflag |= B38400; return false;
 	}
 	// clang-format on
+	return true;
 }
-int serial_init(const char* dev, int baud)
+
+/* saved gets the attributes before, for serial_fini() */
+int serial_init(const char* dev, int baud, struct termios* saved)
 {
+	struct termios tty;
+
 	int fd = open(dev, O_RDWR | O_NOCTTY | O_NDELAY);
 	if (fd < 0) {
 		LOG_ERR("Couldn't open serial device '%s'", dev);
@@ -66,26 +82,18 @@ int serial_init(const char* dev, int baud)
 	}
 
 	/* set necessary serial port attributes */
-	memset(&tty, 0, sizeof tty);
-	memset(&otty, 0, sizeof tty);
-
-	if (tcgetattr(fd, &otty) != 0) {
-		LOG_ERR("Couldn't get termio attrs");
-		close(fd);
-		return -1;
-	}
-
 	if (tcgetattr(fd, &tty) != 0) {
 		LOG_ERR("Couldn't get termio attrs");
 		close(fd);
 		return -1;
 	}
+	*saved = tty;
 
 	tty.c_iflag = IGNPAR;
 	tty.c_oflag = 0;
 	tty.c_cflag = CLOCAL | CREAD | CS8;
 	tty.c_lflag = 0;
-	serial_set_tty_speed(baud);
+	bool std_speed = serial_set_tty_speed(&tty, baud);
 
 	tcflush(fd, TCIFLUSH);
 
@@ -95,10 +103,16 @@ int serial_init(const char* dev, int baud)
 		return -1;
 	}
 
+	if (!std_speed && !serial_set_custom_baudrate(fd, baud)) {
+		close(fd);
+		return -1;
+	}
+
 	return fd;
 }
 
-void serial_fini(int sock)
+/* saved are the attributes from serial_init() of this port */
+void serial_fini(int sock, const struct termios* saved)
 {
 	if (sock < 0) {
 		return;
@@ -111,48 +125,55 @@ void serial_fini(int sock)
 	ioctl(sock, TIOCMSET, &serialLines);
 
 	/* reset terminal settings to original */
-	if (tcsetattr(sock, TCSANOW, &otty) != 0) {
+	if (tcsetattr(sock, TCSANOW, saved) != 0) {
 		LOG_ERR("Couldn't reset termio attrs");
 	}
 
 	close(sock);
 }
 
-bool serial_wait_read_ready(int fd, int sec)
+static bool serial_poll(int fd, short events, int ms)
 {
 	if (fd < 0) {
 		return false;
 	}
 
-	struct timeval tv = {};
-	fd_set fds = {};
-	tv.tv_sec = sec;
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
-	int ret = select(fd + 1, &fds, NULL, NULL, &tv);
+	struct pollfd pfd = {.fd = fd, .events = events};
+	int ret;
+	do {
+		ret = poll(&pfd, 1, ms);
+	} while (ret < 0 && errno == EINTR && ms < 0);
 	return ret <= 0; // error or timeout
 }
 
-bool serial_wait_write_ready(int fd, int sec)
+/* wait up to ms milliseconds, -1 is forever. returns true on timeout */
+bool serial_wait_read_ready(int fd, int ms)
 {
-	if (fd < 0) {
+	return serial_poll(fd, POLLIN, ms);
+}
+
+bool serial_wait_write_ready(int fd, int ms)
+{
+	return serial_poll(fd, POLLOUT, ms);
+}
+
+/* wait until writable, false if the deadline has passed before */
+static bool serial_wait_write_until(int fd, uint64_t deadline)
+{
+	uint64_t now = time_ms();
+	if (now >= deadline) {
 		return false;
 	}
-
-	struct timeval tv = {};
-	fd_set fds = {};
-	tv.tv_sec = sec;
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
-	int ret = select(fd + 1, NULL, &fds, NULL, &tv);
-	return ret <= 0; // error or timeout
+	serial_wait_write_ready(fd, deadline - now);
+	return true;
 }
 
-/* write to serial handling blocking case */
-bool serial_write(int fd, const char* buf, size_t len, int timeout_sec)
+/* write to serial handling blocking case, within timeout_ms in total */
+bool serial_write(int fd, const char* buf, size_t len, int timeout_ms)
 {
 	ssize_t ret;
 	size_t pos = 0;
+	uint64_t deadline = time_ms() + timeout_ms;
 
 	if (fd < 0) {
 		return false;
@@ -163,36 +184,214 @@ bool serial_write(int fd, const char* buf, size_t len, int timeout_sec)
 		if (ret == -1) {
 			if (errno == EAGAIN) {
 				/* write would block, wait until ready again */
-				serial_wait_write_ready(fd, timeout_sec);
+				if (!serial_wait_write_until(fd, deadline)) {
+					LOG_ERR("ERR: write timeout");
+					return false;
+				}
 				continue;
 			} else {
 				/* grave error */
 				LOG_ERR("ERR: write error: %d %s", errno, strerror(errno));
 				return false;
 			}
-		} else if ((size_t)ret < len - pos) {
+		}
+		pos += ret;
+		if (pos < len && !serial_wait_write_until(fd, deadline)) {
 			/* partial writes usually mean next write would return
 			 * EAGAIN, so just wait until it's ready again */
-			serial_wait_write_ready(fd, timeout_sec);
+			LOG_ERR("ERR: write timeout");
+			return false;
 		}
-		pos += ret;
 	} while (pos < len);
 
 	return true;
 }
 
+/* write all iovecs with as few syscalls as possible, handling partial writes
+ * and the blocking case, within timeout_ms in total. iov is modified */
+bool serial_writev(int fd, struct iovec* iov, int iovcnt, int timeout_ms)
+{
+	ssize_t ret;
+	uint64_t deadline = time_ms() + timeout_ms;
+
+	if (fd < 0) {
+		return false;
+	}
+
+	while (iovcnt > 0) {
+		ret = writev(fd, iov, iovcnt);
+		if (ret == -1) {
+			if (errno == EAGAIN) {
+				/* write would block, wait until ready again */
+				if (!serial_wait_write_until(fd, deadline)) {
+					LOG_ERR("ERR: writev timeout");
+					return false;
+				}
+				continue;
+			} else {
+				/* grave error */
+				LOG_ERR("ERR: writev error: %d %s", errno, strerror(errno));
+				return false;
+			}
+		}
+
+		/* skip what was written */
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + ret;
+			iov->iov_len -= ret;
+			/* partial write, see serial_write() */
+			if (!serial_wait_write_until(fd, deadline)) {
+				LOG_ERR("ERR: writev timeout");
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/* bytes written but not sent out on the line yet */
+size_t serial_out_pending(int fd)
+{
+	int n = 0;
+	if (fd < 0 || ioctl(fd, TIOCOUTQ, &n) != 0 || n < 0) {
+		return 0;
+	}
+	return n;
+}
+
+/* milliseconds it takes to send len bytes (8N1) */
+int serial_tx_time(size_t len, int baud)
+{
+	return (uint64_t)len * 10 * 1000 / baud + 1;
+}
+
 bool serial_set_baudrate(int fd, int baud)
 {
 	if (fd < 0) {
 		return false;
 	}
 
+	struct termios tty;
+	if (tcgetattr(fd, &tty) != 0) {
+		LOG_ERR("Couldn't get termio attrs");
+		return false;
+	}
+
 	tty.c_cflag = CLOCAL | CREAD | CS8;
-	serial_set_tty_speed(baud);
+	bool std_speed = serial_set_tty_speed(&tty, baud);
 
 	if (tcsetattr(fd, TCSAFLUSH, &tty) != 0) {
 		LOG_ERR("Couldn't set termio attrs baudrate");
 		return false;
 	}
+
+	if (!std_speed) {
+		return serial_set_custom_baudrate(fd, baud);
+	}
 	return true;
 }
+
+/* inode of the device node fd was opened from */
+ino_t serial_node_ino(int fd)
+{
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		return 0;
+	}
+	return st.st_ino;
+}
+
+/* true if dev is a different node than ino now, e.g. after a USB device
+ * has been reconnected, and can be opened */
+bool serial_node_changed(const char* dev, ino_t ino)
+{
+	struct stat st;
+
+	return stat(dev, &st) == 0 && st.st_ino != ino
+		   && access(dev, R_OK | W_OK) == 0;
+}
+
+/* file descriptor which becomes readable when device nodes are created or
+ * changed, -1 where this is not supported */
+int serial_watch_init(void)
+{
+#ifdef __linux__
+	return inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+	return -1;
+#endif
+}
+
+/* watch the directory of dev, which also catches udev symlinks like
+ * /dev/serial/by-id/... */
+bool serial_watch_add(int wfd, const char* dev)
+{
+#ifdef __linux__
+	char path[PATH_MAX];
+
+	if (wfd < 0) {
+		return false;
+	}
+	snprintf(path, sizeof(path), "%s", dev);
+	/* ATTRIB because udev changes permissions after creating the node */
+	return inotify_add_watch(wfd, dirname(path),
+							 IN_CREATE | IN_ATTRIB | IN_MOVED_TO)
+		   >= 0;
+#else
+	return false;
+#endif
+}
+
+/* discard the events, they are only a hint to check again */
+void serial_watch_drain(int wfd)
+{
+	char buf[4096];
+
+	while (read(wfd, buf, sizeof(buf)) > 0) {
+	}
+}
+
+/* close fd and open dev again as soon as the device node has been
+ * recreated, or after timeout_ms when it wasn't. A USB CDC ACM port
+ * disappears when the device resets */
+int serial_reopen(int fd, struct termios* saved, const char* dev, int baud,
+				  int timeout_ms)
+{
+	ino_t ino = serial_node_ino(fd);
+	uint64_t deadline = time_ms() + timeout_ms;
+	uint64_t now;
+
+	/* watch before closing, so no event is missed */
+	int wfd = serial_watch_init();
+	if (wfd >= 0 && !serial_watch_add(wfd, dev)) {
+		close(wfd);
+		wfd = -1;
+	}
+
+	serial_fini(fd, saved);
+
+	while ((now = time_ms()) < deadline && !serial_node_changed(dev, ino)) {
+		/* inotify wakes up right away, polling is the fallback */
+		int ms = MIN(deadline - now, REOPEN_POLL_INTERVAL);
+		if (wfd >= 0) {
+			if (!serial_wait_read_ready(wfd, ms)) {
+				serial_watch_drain(wfd);
+			}
+		} else {
+			poll(NULL, 0, ms);
+		}
+	}
+
+	if (wfd >= 0) {
+		close(wfd);
+	}
+
+	return serial_init(dev, baud, saved);
+}
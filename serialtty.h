@@ -21,12 +21,30 @@
 #define LIBI_SERIALTTY_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
-int serial_init(const char* device_name, int baud);
-void serial_fini(int sock);
-bool serial_wait_read_ready(int fd, int sec);
-bool serial_wait_write_ready(int fd, int sec);
-bool serial_write(int fd, const char* buf, size_t len, int timeout_sec);
+/* not <termios.h>, it conflicts with <asm/termbits.h> in
+ * serialtty_speed.c */
+struct termios;
+
+int serial_init(const char* device_name, int baud, struct termios* saved);
+void serial_fini(int sock, const struct termios* saved);
+bool serial_wait_read_ready(int fd, int ms);
+bool serial_wait_write_ready(int fd, int ms);
+bool serial_write(int fd, const char* buf, size_t len, int timeout_ms);
+bool serial_writev(int fd, struct iovec* iov, int iovcnt, int timeout_ms);
+size_t serial_out_pending(int fd);
+int serial_tx_time(size_t len, int baud);
+ino_t serial_node_ino(int fd);
+bool serial_node_changed(const char* dev, ino_t ino);
+int serial_watch_init(void);
+bool serial_watch_add(int wfd, const char* dev);
+void serial_watch_drain(int wfd);
+int serial_reopen(int fd, struct termios* saved, const char* dev, int baud,
+				  int timeout_ms);
 bool serial_set_baudrate(int fd, int baud);
+bool serial_set_custom_baudrate(int fd, int baud);
 
 #endif
@@ -0,0 +1,72 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Arbitrary baud rates. This is a separate file because on Linux
+ * <asm/termbits.h> can't be included together with <termios.h> */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#if defined(__linux__)
+#include <asm/termbits.h>
+#elif defined(__APPLE__)
+#include <IOKit/serial/ioss.h>
+#include <termios.h>
+#endif
+
+#include "log.h"
+#include "serialtty.h"
+
+bool serial_set_custom_baudrate(int fd, int baud)
+{
+#if defined(__linux__)
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) != 0) {
+		LOG_ERR("Couldn't get termios2 attrs: %s", strerror(errno));
+		return false;
+	}
+
+	tio.c_cflag &= ~CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_ospeed = baud;
+#ifdef IBSHIFT
+	/* input speed same as output */
+	tio.c_cflag &= ~(CBAUD << IBSHIFT);
+#endif
+	tio.c_ispeed = baud;
+
+	if (ioctl(fd, TCSETS2, &tio) != 0) {
+		LOG_ERR("Couldn't set baudrate %d: %s", baud, strerror(errno));
+		return false;
+	}
+	return true;
+#elif defined(__APPLE__)
+	speed_t speed = baud;
+	if (ioctl(fd, IOSSIOSPEED, &speed) != 0) {
+		LOG_ERR("Couldn't set baudrate %d: %s", baud, strerror(errno));
+		return false;
+	}
+	return true;
+#else
+	LOG_ERR("Unknown baudrate %d", baud);
+	return false;
+#endif
+}
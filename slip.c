@@ -43,13 +43,18 @@
 
 #include <string.h>
 
+/* SLIP_NO_SSE2 selects the word at a time path, for testing it on x86 */
+#if defined(__SSE2__) && !defined(SLIP_NO_SSE2)
+#include <emmintrin.h>
+#endif
+
 #define SLIP_BYTE_END	  0300 /* indicates end of packet */
 #define SLIP_BYTE_ESC	  0333 /* indicates byte stuffing */
 #define SLIP_BYTE_ESC_END 0334 /* ESC ESC_END means END data byte */
 #define SLIP_BYTE_ESC_ESC 0335 /* ESC ESC_ESC means ESC data byte */
 
-int slip_encode(uint8_t* p_output, uint8_t* p_input, uint32_t input_length,
-				uint32_t* p_output_buffer_length)
+int slip_encode_scalar(uint8_t* p_output, uint8_t* p_input,
+					   uint32_t input_length, uint32_t* p_output_buffer_length)
 {
 	if (p_output == NULL || p_input == NULL || p_output_buffer_length == NULL) {
 		return 0;
@@ -79,6 +84,120 @@ int slip_encode(uint8_t* p_output, uint8_t* p_input, uint32_t input_length,
 	return 1;
 }
 
+/* Length of the run of bytes which don't need escaping at the start of p */
+static uint32_t slip_clean_run(const uint8_t* p, uint32_t len)
+{
+	uint32_t i = 0;
+
+#if defined(__SSE2__) && !defined(SLIP_NO_SSE2)
+	const __m128i end = _mm_set1_epi8((char)SLIP_BYTE_END);
+	const __m128i esc = _mm_set1_epi8((char)SLIP_BYTE_ESC);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+		int mask = _mm_movemask_epi8(
+			_mm_or_si128(_mm_cmpeq_epi8(v, end), _mm_cmpeq_epi8(v, esc)));
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#else
+	/* word at a time: a byte of (w ^ pattern) is zero where w matches */
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t highs = 0x8080808080808080ULL;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w, x, y;
+		memcpy(&w, p + i, sizeof(w));
+		x = w ^ (ones * SLIP_BYTE_END);
+		y = w ^ (ones * SLIP_BYTE_ESC);
+		if (((x - ones) & ~x & highs) | ((y - ones) & ~y & highs)) {
+			break;
+		}
+	}
+#endif
+
+	while (i < len && p[i] != SLIP_BYTE_END && p[i] != SLIP_BYTE_ESC) {
+		i++;
+	}
+	return i;
+}
+
+int slip_encode(uint8_t* p_output, uint8_t* p_input, uint32_t input_length,
+				uint32_t* p_output_buffer_length)
+{
+	if (p_output == NULL || p_input == NULL || p_output_buffer_length == NULL) {
+		return 0;
+	}
+
+	uint8_t* out = p_output;
+	uint32_t pos = 0;
+
+	while (pos < input_length) {
+		/* copy bytes which don't need escaping in one go */
+		uint32_t run = slip_clean_run(p_input + pos, input_length - pos);
+		memcpy(out, p_input + pos, run);
+		out += run;
+		pos += run;
+
+		if (pos < input_length) {
+			*out++ = SLIP_BYTE_ESC;
+			*out++ = p_input[pos++] == SLIP_BYTE_END ? SLIP_BYTE_ESC_END
+													 : SLIP_BYTE_ESC_ESC;
+		}
+	}
+	*out++ = SLIP_BYTE_END;
+
+	*p_output_buffer_length = out - p_output;
+	return 1;
+}
+
+int slip_encode_iov(struct iovec* p_iov, int max_iov, const uint8_t* p_input,
+					uint32_t input_length, bool end)
+{
+	static const uint8_t esc_end[] = {SLIP_BYTE_ESC, SLIP_BYTE_ESC_END};
+	static const uint8_t esc_esc[] = {SLIP_BYTE_ESC, SLIP_BYTE_ESC_ESC};
+	static const uint8_t byte_end = SLIP_BYTE_END;
+	uint32_t pos = 0;
+	int n = 0;
+
+	if (p_iov == NULL || p_input == NULL) {
+		return -1;
+	}
+
+	while (pos < input_length) {
+		uint32_t run = slip_clean_run(p_input + pos, input_length - pos);
+		if (run > 0) {
+			if (n >= max_iov) {
+				return -1;
+			}
+			p_iov[n].iov_base = (void*)(p_input + pos);
+			p_iov[n++].iov_len = run;
+			pos += run;
+		}
+
+		if (pos < input_length) {
+			if (n >= max_iov) {
+				return -1;
+			}
+			p_iov[n].iov_base = (void*)(p_input[pos++] == SLIP_BYTE_END
+											? esc_end
+											: esc_esc);
+			p_iov[n++].iov_len = 2;
+		}
+	}
+
+	if (end) {
+		if (n >= max_iov) {
+			return -1;
+		}
+		p_iov[n].iov_base = (void*)&byte_end;
+		p_iov[n++].iov_len = 1;
+	}
+
+	return n;
+}
+
 int slip_decode_add_byte(slip_t* p_slip, uint8_t c)
 {
 	if (p_slip == NULL) {
@@ -137,3 +256,51 @@ int slip_decode_add_byte(slip_t* p_slip, uint8_t c)
 
 	return -3;
 }
+
+uint32_t slip_decode_buffer(slip_t* p_slip, const uint8_t* p_input,
+							uint32_t input_length, int* p_result)
+{
+	uint32_t pos = 0;
+	int ret = -3;
+
+	if (p_slip == NULL || p_input == NULL) {
+		ret = 0;
+		goto out;
+	}
+
+	while (pos < input_length) {
+		if (p_slip->state == SLIP_STATE_DECODING) {
+			/* copy everything up to the next END or ESC in one go */
+			uint32_t run = slip_clean_run(p_input + pos, input_length - pos);
+			uint32_t room = p_slip->buffer_len - p_slip->current_index;
+			if (run > room) {
+				/* the next byte returns -1 below */
+				run = room;
+			}
+			memcpy(p_slip->p_buffer + p_slip->current_index, p_input + pos,
+				   run);
+			p_slip->current_index += run;
+			pos += run;
+		} else if (p_slip->state == SLIP_STATE_CLEARING_INVALID_PACKET) {
+			/* skip to the next END */
+			const uint8_t* end =
+				memchr(p_input + pos, SLIP_BYTE_END, input_length - pos);
+			pos = end ? (uint32_t)(end - p_input) : input_length;
+		}
+
+		if (pos == input_length) {
+			break;
+		}
+
+		ret = slip_decode_add_byte(p_slip, p_input[pos++]);
+		if (ret != -3) {
+			break;
+		}
+	}
+
+out:
+	if (p_result) {
+		*p_result = ret;
+	}
+	return pos;
+}
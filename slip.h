@@ -41,7 +41,9 @@
 #ifndef SLIP_H__
 #define SLIP_H__
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -98,6 +100,33 @@ typedef struct {
 int slip_encode(uint8_t* p_output, uint8_t* p_input, uint32_t input_length,
 				uint32_t* p_output_buffer_length);
 
+/**@brief Byte by byte version of @ref slip_encode.
+ *
+ * @ref slip_encode copies runs of bytes which don't need escaping at once,
+ * using SSE2 or word at a time compares to find them. This is the original
+ * implementation, kept as a reference with the same parameters and output.
+ */
+int slip_encode_scalar(uint8_t* p_output, uint8_t* p_input,
+					   uint32_t input_length, uint32_t* p_output_buffer_length);
+
+/**@brief Function for describing a SLIP encoding without copying the data.
+ *
+ * Fills @p p_iov with pointers into @p p_input for the runs of bytes which
+ * don't need escaping and to constant escape sequences for the others, so
+ * that the encoded packet can be written with writev(). @p p_input must stay
+ * valid until then.
+ *
+ * @param[out]  p_iov         Array of iovecs to fill.
+ * @param[in]   max_iov       Number of iovecs available in @p p_iov.
+ * @param[in]   p_input       The buffer to be encoded.
+ * @param[in]   input_length  The length of the input buffer.
+ * @param[in]   end           Add the END byte which terminates the packet.
+ *
+ * @return Number of iovecs used, or -1 if @p max_iov was too small.
+ */
+int slip_encode_iov(struct iovec* p_iov, int max_iov, const uint8_t* p_input,
+					uint32_t input_length, bool end);
+
 /**@brief Function for decoding a SLIP packet.
  *
  * The decoded packet is put into @p p_slip::p_buffer. The index and buffer
@@ -122,6 +151,24 @@ int slip_encode(uint8_t* p_output, uint8_t* p_input, uint32_t input_length,
  */
 int slip_decode_add_byte(slip_t* p_slip, uint8_t c);
 
+/**@brief Function for decoding a buffer of received bytes.
+ *
+ * Works like calling @ref slip_decode_add_byte for every byte, but copies the
+ * bytes between END and ESC bytes at once. Decoding stops after a packet is
+ * complete or an error occurs, so the rest of the input can be passed in
+ * again for the next packet.
+ *
+ * @param[in,out]   p_slip        State of the decoding process.
+ * @param[in]       p_input       Received bytes.
+ * @param[in]       input_length  Number of received bytes.
+ * @param[out]      p_result      Result of the last byte, the same as the
+ * return values of @ref slip_decode_add_byte.
+ *
+ * @return Number of bytes consumed from @p p_input.
+ */
+uint32_t slip_decode_buffer(slip_t* p_slip, const uint8_t* p_input,
+							uint32_t input_length, int* p_result);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,284 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/* Compares the SLIP encoders against slip_encode_scalar and
+ * slip_decode_buffer against slip_decode_add_byte on random input. Built
+ * twice, the second time with SLIP_NO_SSE2, to cover both versions of the
+ * run search in slip.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slip.h"
+
+#define MAX_LEN	  2048
+#define ROUNDS	  20000
+#define RX_LEN	  1050
+#define END		  0300
+#define ESC		  0333
+
+static int failed;
+
+#define CHECK(cond, ...)                                                       \
+	do {                                                                       \
+		if (!(cond)) {                                                         \
+			fprintf(stderr, "FAIL %s:%d: ", __func__, __LINE__);               \
+			fprintf(stderr, __VA_ARGS__);                                      \
+			fprintf(stderr, "\n");                                             \
+			failed++;                                                          \
+			return;                                                            \
+		}                                                                      \
+	} while (0)
+
+/* Random data with END and ESC bytes at a varying density, so that there are
+ * runs shorter and longer than the 8 and 16 byte blocks of the search */
+static void fill_random(uint8_t* buf, uint32_t len)
+{
+	int density = rand() % 4 == 0 ? 0 : 1 + rand() % 64;
+
+	for (uint32_t i = 0; i < len; i++) {
+		int r = rand();
+		if (density && r % density == 0) {
+			buf[i] = r & 0x100 ? END : ESC;
+		} else {
+			buf[i] = r >> 8;
+		}
+	}
+}
+
+static void test_encode(const uint8_t* in, uint32_t len)
+{
+	static uint8_t ref[2 * MAX_LEN + 1];
+	static uint8_t out[2 * MAX_LEN + 1];
+	static uint8_t cat[2 * MAX_LEN + 1];
+	static struct iovec iov[2 * MAX_LEN + 1];
+	uint32_t ref_len, out_len, cat_len = 0;
+
+	/* the scalar encoder doesn't write the input but isn't const */
+	slip_encode_scalar(ref, (uint8_t*)in, len, &ref_len);
+
+	slip_encode(out, (uint8_t*)in, len, &out_len);
+	CHECK(out_len == ref_len, "slip_encode length %u != %u (input %u)",
+		  out_len, ref_len, len);
+	CHECK(memcmp(out, ref, ref_len) == 0, "slip_encode output differs "
+		  "(input %u)", len);
+
+	int n = slip_encode_iov(iov, 2 * MAX_LEN + 1, in, len, true);
+	CHECK(n > 0, "slip_encode_iov failed (input %u)", len);
+	for (int i = 0; i < n; i++) {
+		CHECK(cat_len + iov[i].iov_len <= ref_len,
+			  "slip_encode_iov too long (input %u)", len);
+		memcpy(cat + cat_len, iov[i].iov_base, iov[i].iov_len);
+		cat_len += iov[i].iov_len;
+	}
+	CHECK(cat_len == ref_len, "slip_encode_iov length %u != %u (input %u)",
+		  cat_len, ref_len, len);
+	CHECK(memcmp(cat, ref, ref_len) == 0, "slip_encode_iov output differs "
+		  "(input %u)", len);
+}
+
+static void test_encode_random(void)
+{
+	static uint8_t in[MAX_LEN + 16];
+
+	for (int r = 0; r < ROUNDS; r++) {
+		uint32_t len = rand() % (r < ROUNDS / 2 ? 64 : MAX_LEN);
+		/* unaligned start for the SSE2 and word loads */
+		uint32_t off = rand() % 16;
+		fill_random(in + off, len);
+		test_encode(in + off, len);
+	}
+}
+
+/* every position of a single END or ESC byte in a block sized input */
+static void test_encode_positions(void)
+{
+	uint8_t in[48];
+
+	for (uint32_t len = 1; len <= sizeof(in); len++) {
+		for (uint32_t pos = 0; pos < len; pos++) {
+			memset(in, 'a', len);
+			in[pos] = END;
+			test_encode(in, len);
+			in[pos] = ESC;
+			test_encode(in, len);
+		}
+	}
+}
+
+/* What a receiver sees: decoded frames and errors, in order */
+struct decode_log {
+	uint8_t buf[24 * MAX_LEN]; /* 6 bytes per input byte at most */
+	uint32_t len;
+};
+
+static void log_result(struct decode_log* log, slip_t* slip, int ret)
+{
+	if (ret == -3) {
+		return;
+	}
+	log->buf[log->len++] = ret + 3;
+	if (ret == 1) {
+		memcpy(log->buf + log->len, &slip->current_index, 4);
+		memcpy(log->buf + log->len + 4, slip->p_buffer, slip->current_index);
+		log->len += 4 + slip->current_index;
+	}
+	/* reset like the receiver in dfu_serial.c */
+	if (ret == 1 || ret == -1) {
+		slip->current_index = 0;
+		slip->state = SLIP_STATE_DECODING;
+	}
+}
+
+static void decode_bytes(struct decode_log* log, uint32_t rx_len,
+						 const uint8_t* in, uint32_t len)
+{
+	static uint8_t buf[RX_LEN];
+	slip_t slip = {.state = SLIP_STATE_DECODING,
+				   .p_buffer = buf,
+				   .buffer_len = rx_len};
+
+	log->len = 0;
+	for (uint32_t i = 0; i < len; i++) {
+		log_result(log, &slip, slip_decode_add_byte(&slip, in[i]));
+	}
+}
+
+/* decode in chunks, the end of one chunk is passed to split[] */
+static void decode_chunks(struct decode_log* log, uint32_t rx_len,
+						  const uint8_t* in, uint32_t len,
+						  const uint32_t* split, int num_split)
+{
+	static uint8_t buf[RX_LEN];
+	slip_t slip = {.state = SLIP_STATE_DECODING,
+				   .p_buffer = buf,
+				   .buffer_len = rx_len};
+	uint32_t start = 0;
+
+	log->len = 0;
+	for (int i = 0; i <= num_split; i++) {
+		uint32_t end = i < num_split ? split[i] : len;
+		while (start < end) {
+			int ret;
+			start += slip_decode_buffer(&slip, in + start, end - start, &ret);
+			log_result(log, &slip, ret);
+		}
+	}
+}
+
+/* A stream of encoded frames, with invalid escapes, raw bytes and frames
+ * longer than the receive buffer in between */
+static uint32_t make_stream(uint8_t* out, uint32_t max)
+{
+	static uint8_t data[RX_LEN + 64];
+	uint32_t len = 0, enc_len;
+
+	while (len + 2 * sizeof(data) + 1 < max) {
+		uint32_t n = rand() % (rand() % 8 ? 80 : sizeof(data));
+		fill_random(data, n);
+		switch (rand() % 8) {
+		case 0:
+			/* invalid escape, the rest is dropped up to the END */
+			out[len++] = ESC;
+			out[len++] = 'x';
+			break;
+		case 1:
+			/* raw data which may contain END and ESC */
+			memcpy(out + len, data, n);
+			len += n;
+			continue;
+		}
+		slip_encode_scalar(out + len, data, n, &enc_len);
+		len += enc_len;
+	}
+	return len;
+}
+
+static void test_decode_random(void)
+{
+	static uint8_t in[4 * MAX_LEN];
+	static struct decode_log ref, out;
+	uint32_t split[32];
+
+	for (int r = 0; r < ROUNDS / 10; r++) {
+		uint32_t len = make_stream(in, sizeof(in));
+		uint32_t rx_len = rand() % 2 ? RX_LEN : 1 + rand() % 64;
+		int num_split = rand() % 32;
+
+		for (int i = 0; i < num_split; i++) {
+			split[i] = rand() % (len + 1);
+		}
+		/* sorted splits, empty chunks are fine */
+		for (int i = 1; i < num_split; i++) {
+			for (int j = i; j > 0 && split[j - 1] > split[j]; j--) {
+				uint32_t t = split[j];
+				split[j] = split[j - 1];
+				split[j - 1] = t;
+			}
+		}
+
+		decode_bytes(&ref, rx_len, in, len);
+		decode_chunks(&out, rx_len, in, len, split, num_split);
+		CHECK(out.len == ref.len && memcmp(out.buf, ref.buf, ref.len) == 0,
+			  "slip_decode_buffer differs (round %d, stream %u)", r, len);
+	}
+}
+
+/* a frame split into two buffers at every position, so also right after and
+ * right before each ESC byte */
+static void test_decode_split(void)
+{
+	static const uint8_t data[] = {'a', END, 'b', 'c', ESC, ESC, 'd', END,
+								   END, 'e', 'f', 'g', 'h', 'i', 'j', 'k',
+								   'l', 'm', 'n', 'o', 'p', 'q', 'r', ESC};
+	static struct decode_log ref, out;
+	uint8_t in[2 * sizeof(data) + 1];
+	uint32_t len;
+
+	slip_encode_scalar(in, (uint8_t*)data, sizeof(data), &len);
+	decode_bytes(&ref, RX_LEN, in, len);
+	CHECK(ref.len == 5 + sizeof(data) && ref.buf[0] == 4 &&
+			  memcmp(ref.buf + 5, data, sizeof(data)) == 0,
+		  "slip_decode_add_byte did not decode the frame");
+
+	for (uint32_t split = 0; split <= len; split++) {
+		decode_chunks(&out, RX_LEN, in, len, &split, 1);
+		CHECK(out.len == ref.len && memcmp(out.buf, ref.buf, ref.len) == 0,
+			  "slip_decode_buffer differs when split at %u", split);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	unsigned int seed = argc > 1 ? strtoul(argv[1], NULL, 0) : 1;
+
+	srand(seed);
+	test_encode_positions();
+	test_encode_random();
+	test_decode_split();
+	test_decode_random();
+
+	if (failed) {
+		fprintf(stderr, "%d failures (seed %u)\n", failed, seed);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
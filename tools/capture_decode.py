@@ -0,0 +1,235 @@
+#!/usr/bin/env python3
+#
+# nrfdfu - Nordic DFU Upgrade Utility
+#
+# Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+"""Decode a nrfdfu --capture file into per port DFU timelines.
+
+Prints every request and response with the time since the start of the
+capture and the latency of each response to its request. Consecutive object
+writes are folded into one line. With --summary only the per opcode latency
+statistics are printed."""
+
+import argparse
+import struct
+import sys
+
+OPCODES = {
+    0x00: "PROTOCOL_VERSION",
+    0x01: "CREATE",
+    0x02: "PRN_SET",
+    0x03: "CRC_GET",
+    0x04: "EXECUTE",
+    0x06: "SELECT",
+    0x07: "MTU_GET",
+    0x08: "WRITE",
+    0x09: "PING",
+    0x0A: "HW_VERSION",
+    0x0B: "FW_VERSION",
+    0x0C: "ABORT",
+}
+
+RESULTS = {
+    0x00: "INVALID",
+    0x01: "SUCCESS",
+    0x02: "NOT_SUPPORTED",
+    0x03: "INVALID_PARAMETER",
+    0x04: "INSUFFICIENT_RESOURCES",
+    0x05: "INVALID_OBJECT",
+    0x07: "UNSUPPORTED_TYPE",
+    0x08: "NOT_PERMITTED",
+    0x0A: "OPERATION_FAILED",
+    0x0B: "EXT_ERROR",
+}
+
+OP_RESPONSE = 0x60
+OP_WRITE = 0x08
+DIR_RX = 1
+DIR_TX = 2
+
+BT_SHB = 0x0A0D0D0A
+BT_IDB = 0x00000001
+BT_EPB = 0x00000006
+OPT_IF_NAME = 2
+OPT_EPB_FLAGS = 2
+
+
+def opname(op):
+    return OPCODES.get(op, "0x%02x" % op)
+
+
+def options(data):
+    """Yield (code, value) of a pcapng option list."""
+    pos = 0
+    while pos + 4 <= len(data):
+        code, length = struct.unpack_from("<HH", data, pos)
+        if code == 0:
+            break
+        yield code, data[pos + 4:pos + 4 + length]
+        pos += 4 + ((length + 3) & ~3)
+
+
+def read_capture(f):
+    """Return the interface names and a list of (ts_us, intf, dir, frame)."""
+    ports = []
+    frames = []
+    while True:
+        hdr = f.read(8)
+        if len(hdr) < 8:
+            break
+        btype, blen = struct.unpack("<II", hdr)
+        if blen < 12:
+            raise ValueError("corrupt block length %d" % blen)
+        body = f.read(blen - 8)
+        if len(body) < blen - 8:
+            break  # truncated by an interrupted run
+        body = body[:-4]
+        if btype == BT_SHB:
+            if struct.unpack_from("<I", body)[0] != 0x1A2B3C4D:
+                raise ValueError("not a little endian pcapng file")
+        elif btype == BT_IDB:
+            name = "if%d" % len(ports)
+            for code, val in options(body[8:]):
+                if code == OPT_IF_NAME:
+                    name = val.decode(errors="replace")
+            ports.append(name)
+        elif btype == BT_EPB:
+            intf, ts_hi, ts_lo, caplen, _ = struct.unpack_from("<IIIII", body)
+            frame = body[20:20 + caplen]
+            direction = 0
+            for code, val in options(body[20 + ((caplen + 3) & ~3):]):
+                if code == OPT_EPB_FLAGS:
+                    direction = struct.unpack("<I", val)[0] & 3
+            frames.append(((ts_hi << 32) | ts_lo, intf, direction, frame))
+    return ports, frames
+
+
+class Port:
+    def __init__(self, name):
+        self.name = name
+        self.pending = {}
+        self.writes = None  # [first_ts, last_ts, packets, bytes]
+        self.lines = []
+
+    def flush_writes(self, fmt_ts):
+        if self.writes:
+            first, last, packets, nbytes = self.writes
+            self.lines.append("%s TX WRITE %d packets %d bytes in %.3f ms"
+                              % (fmt_ts(first), packets, nbytes,
+                                 (last - first) / 1000.0))
+            self.writes = None
+
+
+def describe(frame):
+    """Short description of the response payload."""
+    op, res = frame[1], frame[2]
+    text = RESULTS.get(res, "0x%02x" % res)
+    payload = frame[3:]
+    if res == 0x01:
+        if op in (0x03, OP_WRITE) and len(payload) >= 8:
+            off, crc = struct.unpack_from("<II", payload)
+            text = "offset=%d crc=%08x" % (off, crc)
+        elif op == 0x06 and len(payload) >= 12:
+            size, off, crc = struct.unpack_from("<III", payload)
+            text = "max=%d offset=%d crc=%08x" % (size, off, crc)
+        elif op == 0x07 and len(payload) >= 2:
+            text = "mtu=%d" % struct.unpack_from("<H", payload)[0]
+    elif res == 0x0B and payload:
+        text += " 0x%02x" % payload[0]
+    return text
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("capture", help="pcapng file written by nrfdfu --capture")
+    ap.add_argument("-s", "--summary", action="store_true",
+                    help="print only per opcode latency statistics")
+    ap.add_argument("-p", "--port", help="only show this port")
+    args = ap.parse_args()
+
+    with open(args.capture, "rb") as f:
+        names, frames = read_capture(f)
+    if not frames:
+        print("no frames", file=sys.stderr)
+        return 1
+
+    start = min(fr[0] for fr in frames)
+
+    def fmt_ts(ts):
+        return "%10.3f" % ((ts - start) / 1000.0)
+
+    ports = [Port(n) for n in names]
+    stats = {}  # opcode -> list of latencies in us
+
+    for ts, intf, direction, frame in frames:
+        if intf >= len(ports) or not frame:
+            continue
+        p = ports[intf]
+        if args.port and p.name != args.port:
+            continue
+        op = frame[0]
+        if direction == DIR_TX and op == OP_WRITE:
+            nbytes = len(frame) - 1
+            if p.writes:
+                p.writes[1] = ts
+                p.writes[2] += 1
+                p.writes[3] += nbytes
+            else:
+                p.writes = [ts, ts, 1, nbytes]
+            continue
+        p.flush_writes(fmt_ts)
+        if direction == DIR_TX:
+            p.pending[op] = ts
+            p.lines.append("%s TX %s" % (fmt_ts(ts), opname(op)))
+        elif op == OP_RESPONSE and len(frame) >= 3:
+            req = frame[1]
+            sent = p.pending.pop(req, None)
+            if sent is None:
+                # receipt notification after PRN write packets
+                p.lines.append("%s RX %s notify %s"
+                               % (fmt_ts(ts), opname(req), describe(frame)))
+                continue
+            lat = ts - sent
+            stats.setdefault(req, []).append(lat)
+            p.lines.append("%s RX %s %s (%.3f ms)"
+                           % (fmt_ts(ts), opname(req), describe(frame),
+                              lat / 1000.0))
+        else:
+            p.lines.append("%s RX garbage %s" % (fmt_ts(ts), frame.hex()))
+
+    if not args.summary:
+        for p in ports:
+            p.flush_writes(fmt_ts)
+            if not p.lines:
+                continue
+            print("%s:" % p.name)
+            for line in p.lines:
+                print(line)
+
+    print("%-16s %6s %10s %10s %10s" % ("opcode", "count", "min ms",
+                                        "avg ms", "max ms"))
+    for op in sorted(stats):
+        lat = stats[op]
+        print("%-16s %6d %10.3f %10.3f %10.3f"
+              % (opname(op), len(lat), min(lat) / 1000.0,
+                 sum(lat) / len(lat) / 1000.0, max(lat) / 1000.0))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
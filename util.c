@@ -20,17 +20,28 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
+#include "log.h"
 #include "util.h"
 
 /* dump data in same format as nrfutil (integer) */
 void dump_data(const char* txt, const uint8_t* data, size_t len)
 {
-	printf("[ %s", txt);
-	for (int i = 0; i < len; i++) {
-		printf("%d ", *(data + i));
+	char buf[1024] = "";
+	size_t pos = 0;
+	size_t i;
+
+	/* format in one go instead of a printf for every byte, leaving room
+	 * for the marker of what did not fit */
+	for (i = 0; i < len && pos < sizeof(buf) - 32; i++) {
+		pos += snprintf(buf + pos, sizeof(buf) - pos, "%d ", data[i]);
+	}
+	if (i < len) {
+		snprintf(buf + pos, sizeof(buf) - pos, "... (%zu more bytes) ",
+				 len - i);
 	}
-	printf("]\n");
+	log_out(LL_DEBUG, true, "[ %s%s]", txt, buf);
 }
 
 static uint8_t hex_digit(char ch)
@@ -63,3 +74,18 @@ bool hex_to_bin(const char* hex, uint8_t* bin, size_t len)
 	}
 	return true;
 }
+
+/* milliseconds from a monotonic clock */
+uint64_t time_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
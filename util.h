@@ -33,8 +33,12 @@
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 void dump_data(const char* txt, const uint8_t* data, size_t len);
 bool hex_to_bin(const char* hex, uint8_t* bin, size_t len);
+uint64_t time_ms(void);
+uint64_t time_us(void);
 
 #endif